@@ -0,0 +1,324 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <my_malloc.h>
+#include <pthread.h>
+#include <stdint.h>
+
+/*
+ * Upper bound on the number of arenas. The number actually used defaults to
+ * the number of online CPUs and can be lowered with the MALLOC_ARENAS
+ * environment variable.
+ */
+
+#define MAX_ARENAS (64)
+
+/*
+ * Requests of at least this many bytes bypass the arenas and are mapped
+ * directly from the OS. Can be changed at startup with the
+ * MALLOC_MMAP_THRESHOLD environment variable.
+ */
+
+#ifndef MMAP_THRESHOLD
+#define MMAP_THRESHOLD (128 * 1024)
+#endif
+
+/*
+ * Once a free block grows to this many bytes, my_free() gives memory back
+ * to the OS: the top of the arena's heap is decommitted, or cut off with a
+ * negative sbrk, and the pages of large freed blocks are released with
+ * madvise. Can be changed at startup with the MALLOC_TRIM_THRESHOLD
+ * environment variable, where 0 turns it off.
+ */
+
+#ifndef TRIM_THRESHOLD
+#define TRIM_THRESHOLD (128 * 1024)
+#endif
+
+/*
+ * An arena that runs out of memory grows by as much as it already has, so
+ * a growing heap doubles and warms up with a logarithmic number of
+ * system calls. Growth starts at GROW_MIN bytes, is never more than GROW_MAX at a
+ * time, and always fits the request that triggered it. Both can be changed
+ * at startup with the MALLOC_GROW_MIN and MALLOC_GROW_MAX environment
+ * variables; setting them to the same value grows by a fixed amount.
+ */
+
+#ifndef GROW_MIN
+#define GROW_MIN (ARENA_SIZE)
+#endif
+
+#ifndef GROW_MAX
+#define GROW_MAX (16 * 1024 * 1024)
+#endif
+
+/*
+ * Each arena reserves a range of HEAP_RESERVE_SIZE bytes of address space
+ * with mmap(PROT_NONE) and grows by committing the next part of it with
+ * mprotect, so an arena's chunks are always contiguous and merge with each
+ * other, nothing else can take the space in between, and each arena can be
+ * trimmed on its own. An arena that fills its range reserves another one.
+ * The size can be changed at startup with the MALLOC_HEAP_RESERVE
+ * environment variable.
+ *
+ * Building with HEAP_SBRK defined grows all arenas with sbrk instead, out of
+ * the one program break they share with anything else that moves it.
+ */
+
+#ifndef HEAP_RESERVE_SIZE
+#define HEAP_RESERVE_SIZE ((size_t) 64 << 30)
+#endif
+
+/*
+ * With the MALLOC_HUGEPAGES environment variable set to 1, the arenas'
+ * ranges are HUGE_PAGE_SIZE aligned and marked for transparent huge pages,
+ * and chunks are whole huge pages so their fenceposts never split one. In
+ * the HEAP_SBRK build the arenas then grow out of shared regions reserved
+ * with mmap instead of with sbrk. If the kernel has transparent huge pages
+ * turned off or refuses the advice, the arenas go on with normal pages.
+ */
+
+#define HUGE_PAGE_SIZE ((size_t) 2 * 1024 * 1024)
+
+#ifndef HUGE_REGION_SIZE
+#define HUGE_REGION_SIZE ((size_t) 1 << 30)
+#endif
+
+/*
+ * With COMPACT_HEADERS defined, allocated blocks carry only their size word
+ * and the payload starts where left_size would be. The size of a free block
+ * is repeated in a footer in its last word, and the LEFT_FREE bit in a
+ * block's size tells whether that footer is there to be read, so left_size
+ * is never needed. Fenceposts shrink to a single word as well. Free blocks
+ * still hold next and prev at their usual offsets, so every block needs room
+ * for the links plus the footer.
+ *
+ * The default layout keeps the full header in every block.
+ *
+ * In both layouts a free block also keeps the word right after its links
+ * for the address ordered tree, so blocks are never smaller than that.
+ */
+
+#ifdef COMPACT_HEADERS
+#define BLOCK_HEADER_SIZE (sizeof(size_t))
+#define MIN_BLOCK_SIZE (sizeof(header) - BLOCK_HEADER_SIZE + \
+                        2 * sizeof(size_t))
+#else
+#define BLOCK_HEADER_SIZE (ALLOC_HEADER_SIZE)
+#define MIN_BLOCK_SIZE (2 * sizeof(header *) + sizeof(size_t))
+#endif
+
+/*
+ * State bit set, together with ALLOCATED, on blocks that were mapped
+ * directly with mmap rather than carved out of an arena. They have no
+ * neighbors and are unmapped as soon as they are freed.
+ *
+ * The compact layout needs the third bit for LEFT_FREE, so there mapped
+ * blocks are marked ALLOCATED | FENCEPOST instead, a combination no arena
+ * block ever has.
+ */
+
+#ifdef COMPACT_HEADERS
+#define MMAPPED (0b010)
+#define LEFT_FREE (0b100)
+#define STATE_MASK (0b011)
+#else
+#define MMAPPED (0b100)
+#define STATE_MASK (0b111)
+#endif
+
+#define BLOCK_STATE(h) ((h)->size & STATE_MASK)
+
+/*
+ * Alignment of every payload outside the slabs, matching what the C library
+ * guarantees so the allocator can stand in for malloc(). Chunks start on a
+ * page boundary and every block spans a multiple of BLOCK_ALIGNMENT bytes
+ * including its header, so payloads stay aligned through splits and merges.
+ */
+
+#define BLOCK_ALIGNMENT (16)
+
+/*
+ * FIT_ALGORITHM picks the fit policy the arenas start with, and the
+ * MALLOC_FIT environment variable overrides it at startup with a policy
+ * number or "adaptive". An adaptive arena starts out with next fit and
+ * every ADAPT_WINDOW searches looks at how long its next fit searches were
+ * and how fragmented its free memory is. It moves to best fit when either
+ * gets too high, and back to next fit only once fragmentation has stayed
+ * below ADAPT_FRAG_LOW with a short freelist for ADAPT_CALM_WINDOWS
+ * windows in a row, so it doesn't flip back and forth around a threshold.
+ */
+
+#define FIT_ADAPTIVE (0)
+#define ADAPT_WINDOW (4096)
+#define ADAPT_SEARCH_HIGH (32.0)
+#define ADAPT_FRAG_HIGH (0.5)
+#define ADAPT_FRAG_LOW (0.2)
+#define ADAPT_CALM_WINDOWS (8)
+
+/* Free memory below which fragmentation is not worth reacting to */
+#define ADAPT_MIN_FREE (64 * 1024)
+
+/*
+ * With ADDRESS_ORDERED set to 1, the list based policies (first, next and
+ * worst fit) keep an arena's free blocks in address order instead of
+ * pushing freed blocks onto the front of the freelist, so first fit hands
+ * out the lowest addressed block that fits and live data packs towards the
+ * bottom of the heap. The order is kept in a treap threaded through the
+ * free blocks, keyed by address, in which every block records the biggest
+ * block size below it. Freeing a block doesn't walk the list, and a search
+ * skips every subtree with nothing big enough, so both take O(log n) steps
+ * in expectation whatever the sizes of the blocks. Can be changed at
+ * startup with the MALLOC_ADDRESS_ORDERED environment variable.
+ */
+
+#ifndef ADDRESS_ORDERED
+#define ADDRESS_ORDERED (0)
+#endif
+
+/*
+ * Freed arena blocks of up to FASTBIN_MAX_SIZE bytes are parked on a LIFO
+ * list per exact size instead of being coalesced, and handed straight back
+ * out by the next request of that size. They stay marked ALLOCATED while
+ * they wait, so their neighbors never merge with them. The fastbins are
+ * consolidated into the freelist when a search of the freelist fails or
+ * they hold more than FASTBIN_MAX_BYTES. Setting FASTBIN_MAX_SIZE to 0
+ * disables them.
+ */
+
+#ifndef FASTBIN_MAX_SIZE
+#define FASTBIN_MAX_SIZE (256)
+#endif
+
+#ifndef FASTBIN_MAX_BYTES
+#define FASTBIN_MAX_BYTES (64 * 1024)
+#endif
+
+#define FASTBIN_COUNT ((FASTBIN_MAX_SIZE / BLOCK_ALIGNMENT) + 1)
+
+/*
+ * A thread freeing a block that belongs to an arena other than its own
+ * pushes it onto that arena's remote free queue with a single
+ * compare-and-swap instead of taking the arena's lock. The queue is drained
+ * in bulk by the next thread to allocate from the arena, or by the thread
+ * whose push takes it past REMOTE_FREE_MAX blocks.
+ */
+
+#ifndef REMOTE_FREE_MAX
+#define REMOTE_FREE_MAX (256)
+#endif
+
+/*
+ * Two-level segregated fit (TLSF) index, used instead of the freelist
+ * when the fit policy is 5. Free blocks are bucketed by the position of
+ * their highest set bit (first level) and then by the next TLSF_SL_LOG2 bits
+ * of their size (second level). One bitmap per level records which buckets
+ * are non-empty, so finding a block is a couple of find-first-set operations
+ * no matter how many fragments the heap has.
+ */
+
+#define TLSF_SL_LOG2 (4)
+#define TLSF_SL_COUNT (1 << TLSF_SL_LOG2)
+#define TLSF_ALIGN_LOG2 (3)
+#define TLSF_FL_SHIFT (TLSF_SL_LOG2 + TLSF_ALIGN_LOG2)
+#define TLSF_FL_MAX (48)
+#define TLSF_FL_COUNT (TLSF_FL_MAX - TLSF_FL_SHIFT + 1)
+#define TLSF_SMALL_BLOCK_SIZE ((size_t) 1 << TLSF_FL_SHIFT)
+
+/*
+ * An independent heap. Each arena grows its own chunks from the OS and
+ * keeps its own free blocks and lock, so threads assigned to different
+ * arenas never contend with each other. Blocks never coalesce across
+ * arenas, which lets my_free() find the owner of any block from its address.
+ */
+
+typedef struct arena {
+  /* Mutex to ensure thread safety for this arena's freelist */
+  pthread_mutex_t mutex;
+
+  /* Pointer to the head of the free list */
+  header *freelist_head;
+
+  /*
+   * Pointer to the second fencepost in the most recently allocated chunk
+   * from the OS. Used for coalescing chunks
+   */
+  header *last_fence_post;
+
+  /*
+   * Pointer to the next block in the freelist after the block that was last
+   * allocated. If the block pointed to is removed by coalescing, this is
+   * updated to point to the next block after the removed block.
+   */
+  header *next_allocate;
+
+  /* Root of the (size, address) ordered tree used by best fit */
+  header *tree_root;
+
+  /* Root of the address ordered tree used by first, next and worst fit */
+  /* when address_ordered is set */
+  header *address_root;
+
+  /* TLSF bucket bitmaps and bucket list heads */
+  uint64_t tlsf_fl_bitmap;
+  uint32_t tlsf_sl_bitmap[TLSF_FL_COUNT];
+  header *tlsf_blocks[TLSF_FL_COUNT][TLSF_SL_COUNT];
+
+  /* Fit policy the free blocks are indexed for, a FIT_ALGORITHM value */
+  int fit;
+
+  /* Whether first, next and worst fit keep the free blocks in address */
+  /* order, see ADDRESS_ORDERED */
+  bool address_ordered;
+
+  /* State of the adaptive policy: the current window's searches and the */
+  /* blocks they examined, the results of the last complete window, and */
+  /* the switches made so far */
+  bool adaptive;
+  size_t window_searches;
+  size_t window_steps;
+  unsigned int calm_windows;
+  double search_length;
+  double fragmentation;
+  size_t fit_switches;
+  const char *switch_reason;
+
+  /* Small freed blocks waiting to be reused or coalesced, and their bytes */
+  header *fastbins[FASTBIN_COUNT];
+  size_t fastbin_bytes;
+
+  /* Bytes of the blocks this arena has handed out, headers included */
+  size_t bytes_in_use;
+
+  /* Bytes of the chunks this arena got from the OS, less what trimming */
+  /* gave back, which is how much it grows by next */
+  size_t heap_bytes;
+
+  /* The arena's current reserved range: committed from heap_start up to */
+  /* heap_end, and reserved up to heap_limit */
+  char *heap_start;
+  char *heap_end;
+  char *heap_limit;
+
+  /* Position of this arena in g_arenas */
+  int index;
+
+  /* Blocks freed by threads of other arenas, linked through next and */
+  /* waiting to be freed here, and how many there are. Pushed to without */
+  /* the lock, so they get a cache line of their own. */
+  header *remote_frees __attribute__((aligned(64)));
+  size_t remote_count;
+} arena;
+
+extern arena g_arenas[MAX_ARENAS];
+extern int g_arena_count;
+
+/*
+ * Calls visit on every free block of arena a, in whichever index its fit
+ * policy keeps them: the freelist, the TLSF buckets, the best fit tree or
+ * the address ordered tree. visit must not add or remove free blocks.
+ */
+
+void visit_free_blocks(arena *a, void (*visit)(header *, void *), void *arg);
+
+#endif // ARENA_H
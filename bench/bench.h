@@ -0,0 +1,93 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <time.h>
+
+/*
+ * Shared pieces of the benchmarks. Building with BENCH_GLIBC defined runs
+ * the same workloads against the C library's allocator instead of
+ * my_malloc, for comparison.
+ */
+
+#ifdef BENCH_GLIBC
+#define bench_malloc(size) malloc(size)
+#define bench_free(p) free(p)
+#define bench_realloc(p, size) realloc(p, size)
+#define BENCH_ALLOCATOR "glibc"
+#define BENCH_FIT (0)
+#define BENCH_ADDRESS_ORDERED (0)
+#else
+#include <my_malloc.h>
+#include <my_malloc_ext.h>
+#define bench_malloc(size) my_malloc(size)
+#define bench_free(p) my_free(p)
+#define bench_realloc(p, size) my_realloc(p, size)
+#define BENCH_ALLOCATOR "my_malloc"
+#define BENCH_FIT (bench_fit())
+#define BENCH_ADDRESS_ORDERED (bench_address_ordered())
+#endif
+
+#ifndef BENCH_COMMIT
+#define BENCH_COMMIT "unknown"
+#endif
+
+#ifndef BENCH_GLIBC
+/*
+ * Returns the fit policy the allocator is running with, which MALLOC_FIT
+ * may have changed from FIT_ALGORITHM, or 0 if it is adaptive.
+ */
+
+static inline int bench_fit(void) {
+  malloc_policy policy;
+  my_malloc_policy(0, &policy);
+  return policy.adaptive ? 0 : policy.fit;
+} /* bench_fit() */
+
+/*
+ * Returns 1 if the allocator keeps free blocks in address order, which
+ * MALLOC_ADDRESS_ORDERED may have changed from ADDRESS_ORDERED.
+ */
+
+static inline int bench_address_ordered(void) {
+  malloc_policy policy;
+  my_malloc_policy(0, &policy);
+  return policy.address_ordered;
+} /* bench_address_ordered() */
+#endif
+
+/*
+ * Returns a monotonic timestamp in nanoseconds.
+ */
+
+static inline uint64_t bench_now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (((uint64_t) ts.tv_sec) * 1000000000ULL) + ts.tv_nsec;
+} /* bench_now_ns() */
+
+/*
+ * xorshift64* generator, so every run and every allocator sees the same
+ * sequence of requests. *state must not be 0.
+ */
+
+static inline uint64_t bench_random(uint64_t *state) {
+  *state ^= *state >> 12;
+  *state ^= *state << 25;
+  *state ^= *state >> 27;
+  return *state * 2685821657736338717ULL;
+} /* bench_random() */
+
+/*
+ * Returns the peak resident set size of the process in KiB.
+ */
+
+static inline long bench_peak_rss_kb(void) {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss;
+} /* bench_peak_rss_kb() */
+
+#endif // BENCH_H
@@ -0,0 +1,288 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.h"
+
+/*
+ * Single threaded workloads for comparing the fit policies with each other
+ * and with glibc. Usage:
+ *
+ *   fit_bench <workload> [calls]
+ *
+ * Each workload runs twice with the same request sequence: once untimed to
+ * measure throughput, peak RSS and the fragmentation left behind, and once
+ * timing every call for the latency percentiles. The results are printed as
+ * a single line of JSON.
+ */
+
+#define DEFAULT_CALLS (1000000)
+
+/* Latencies recorded in the timed pass, in nanoseconds */
+#define MAX_LATENCIES (1 << 21)
+static uint32_t g_latencies[MAX_LATENCIES];
+static size_t g_latency_count = 0;
+static bool g_timing = false;
+
+/* Live blocks of the running workload */
+#define SLOT_COUNT (8192)
+static void *g_slots[SLOT_COUNT];
+static size_t g_slot_sizes[SLOT_COUNT];
+
+/* Calls made so far by the running workload */
+static size_t g_calls = 0;
+
+/*
+ * Records the duration of one call if this is the timed pass.
+ */
+
+static inline void record(uint64_t start) {
+  uint64_t elapsed = bench_now_ns() - start;
+  if (g_latency_count < MAX_LATENCIES) {
+    g_latencies[g_latency_count++] = (elapsed > UINT32_MAX) ?
+                                     UINT32_MAX : (uint32_t) elapsed;
+  }
+} /* record() */
+
+/*
+ * malloc, free and realloc wrappers that count calls, time them in the timed
+ * pass and touch new memory the way a real program would.
+ */
+
+static void *timed_malloc(size_t size) {
+  g_calls++;
+  uint64_t start = g_timing ? bench_now_ns() : 0;
+  char *p = bench_malloc(size);
+  if (g_timing) {
+    record(start);
+  }
+  if (p == NULL) {
+    fprintf(stderr, "fit_bench: out of memory\n");
+    exit(1);
+  }
+  p[0] = 1;
+  return p;
+} /* timed_malloc() */
+
+static void timed_free(void *p) {
+  g_calls++;
+  uint64_t start = g_timing ? bench_now_ns() : 0;
+  bench_free(p);
+  if (g_timing) {
+    record(start);
+  }
+} /* timed_free() */
+
+static void *timed_realloc(void *p, size_t size) {
+  g_calls++;
+  uint64_t start = g_timing ? bench_now_ns() : 0;
+  char *new_p = bench_realloc(p, size);
+  if (g_timing) {
+    record(start);
+  }
+  if (new_p == NULL) {
+    fprintf(stderr, "fit_bench: out of memory\n");
+    exit(1);
+  }
+  new_p[size - 1] = 1;
+  return new_p;
+} /* timed_realloc() */
+
+/*
+ * Replaces the block in the given slot with a new one of the given size.
+ */
+
+static inline void replace_slot(size_t slot, size_t size) {
+  if (g_slots[slot] != NULL) {
+    timed_free(g_slots[slot]);
+  }
+  g_slots[slot] = timed_malloc(size);
+  g_slot_sizes[slot] = size;
+} /* replace_slot() */
+
+/*
+ * Fixed size churn: random blocks of a 1024 block live set are freed and
+ * allocated again with the same size.
+ */
+
+static void churn(size_t calls, uint64_t *rng) {
+  while (g_calls < calls) {
+    replace_slot(bench_random(rng) % 1024, 128);
+  }
+} /* churn() */
+
+/*
+ * Random sizes: like churn, but over 4096 blocks of 16 to 4096 bytes.
+ */
+
+static void random_sizes(size_t calls, uint64_t *rng) {
+  while (g_calls < calls) {
+    uint64_t r = bench_random(rng);
+    replace_slot(r % 4096, 16 + ((r >> 32) % 4081));
+  }
+} /* random_sizes() */
+
+/*
+ * Producer/consumer: blocks are freed in the order they were allocated,
+ * 4096 allocations after they were made.
+ */
+
+static void producer_consumer(size_t calls, uint64_t *rng) {
+  size_t head = 0;
+  while (g_calls < calls) {
+    replace_slot(head, 32 + (bench_random(rng) % 993));
+    head = (head + 1) % 4096;
+  }
+} /* producer_consumer() */
+
+/*
+ * Realloc growth: 256 buffers grow a little at a time up to 64 KiB, and
+ * start over from 16 bytes once they get there.
+ */
+
+static void realloc_growth(size_t calls, uint64_t *rng) {
+  while (g_calls < calls) {
+    uint64_t r = bench_random(rng);
+    size_t slot = r % 256;
+    size_t size = g_slot_sizes[slot] + 16 + ((r >> 32) % 241);
+    if (size > 64 * 1024) {
+      replace_slot(slot, 16);
+      continue;
+    }
+    g_slots[slot] = timed_realloc(g_slots[slot], size);
+    g_slot_sizes[slot] = size;
+  }
+} /* realloc_growth() */
+
+/*
+ * Long-lived/short-lived mix: a set of 1024 long lived blocks is replaced
+ * slowly while most allocations are freed again within 64 calls.
+ */
+
+static void mixed_lifetimes(size_t calls, uint64_t *rng) {
+  size_t short_slot = 0;
+  while (g_calls < calls) {
+    uint64_t r = bench_random(rng);
+    if ((r % 100) < 2) {
+      replace_slot((r >> 16) % 1024, 64 + ((r >> 32) % 8129));
+    }
+    else {
+      replace_slot(1024 + short_slot, 16 + ((r >> 32) % 497));
+      short_slot = (short_slot + 1) % 64;
+    }
+  }
+} /* mixed_lifetimes() */
+
+/*
+ * Frees every block the workload left behind.
+ */
+
+static void free_slots(void) {
+  for (size_t slot = 0; slot < SLOT_COUNT; slot++) {
+    if (g_slots[slot] != NULL) {
+      bench_free(g_slots[slot]);
+      g_slots[slot] = NULL;
+    }
+    g_slot_sizes[slot] = 0;
+  }
+} /* free_slots() */
+
+/*
+ * qsort comparator for latencies.
+ */
+
+static int compare_latencies(const void *a, const void *b) {
+  uint32_t x = *((const uint32_t *) a);
+  uint32_t y = *((const uint32_t *) b);
+  return (x > y) - (x < y);
+} /* compare_latencies() */
+
+/*
+ * Returns the given percentile of the sorted latencies.
+ */
+
+static uint32_t percentile(double fraction) {
+  if (g_latency_count == 0) {
+    return 0;
+  }
+  size_t index = (size_t) (fraction * (g_latency_count - 1));
+  return g_latencies[index];
+} /* percentile() */
+
+typedef struct workload {
+  const char *name;
+  void (*run)(size_t calls, uint64_t *rng);
+} workload;
+
+static const workload g_workloads[] = {
+  { "churn", churn },
+  { "random", random_sizes },
+  { "prodcons", producer_consumer },
+  { "realloc", realloc_growth },
+  { "mixed", mixed_lifetimes },
+};
+
+#define WORKLOAD_COUNT (sizeof(g_workloads) / sizeof(g_workloads[0]))
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s <workload> [calls]\n", argv[0]);
+    return 2;
+  }
+
+  const workload *w = NULL;
+  for (size_t i = 0; i < WORKLOAD_COUNT; i++) {
+    if (strcmp(argv[1], g_workloads[i].name) == 0) {
+      w = &g_workloads[i];
+    }
+  }
+  if (w == NULL) {
+    fprintf(stderr, "fit_bench: unknown workload %s\n", argv[1]);
+    return 2;
+  }
+  size_t calls = (argc > 2) ? strtoul(argv[2], NULL, 0) : DEFAULT_CALLS;
+
+  /* throughput pass */
+  uint64_t rng = 0x9e3779b97f4a7c15ULL;
+  g_calls = 0;
+  uint64_t start = bench_now_ns();
+  w->run(calls, &rng);
+  uint64_t elapsed = bench_now_ns() - start;
+  size_t throughput_calls = g_calls;
+
+  /* what the workload leaves behind, before it is cleaned up */
+  double fragmentation = -1.0;
+#ifndef BENCH_GLIBC
+  fragmentation = my_malloc_stats().fragmentation;
+#endif
+  free_slots();
+  long peak_rss_kb = bench_peak_rss_kb();
+
+  /* latency pass over the same requests */
+  rng = 0x9e3779b97f4a7c15ULL;
+  g_calls = 0;
+  g_timing = true;
+  w->run(calls, &rng);
+  g_timing = false;
+  free_slots();
+  qsort(g_latencies, g_latency_count, sizeof(g_latencies[0]),
+        compare_latencies);
+
+  printf("{\"commit\": \"%s\", \"allocator\": \"%s\", \"fit\": %d, "
+         "\"address_ordered\": %d, \"workload\": \"%s\", \"calls\": %zu, "
+         "\"ops_per_sec\": %.0f, \"p50_ns\": %u, \"p99_ns\": %u, "
+         "\"p999_ns\": %u, \"peak_rss_kb\": %ld, ",
+         BENCH_COMMIT, BENCH_ALLOCATOR, BENCH_FIT, BENCH_ADDRESS_ORDERED,
+         w->name, throughput_calls,
+         throughput_calls / (elapsed / 1e9), percentile(0.5),
+         percentile(0.99), percentile(0.999), peak_rss_kb);
+  if (fragmentation < 0) {
+    printf("\"fragmentation\": null}\n");
+  }
+  else {
+    printf("\"fragmentation\": %.4f}\n", fragmentation);
+  }
+  return 0;
+} /* main() */
@@ -0,0 +1,394 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "bench.h"
+
+/*
+ * Multi-threaded allocator stress tests, ported from the classic allocator
+ * benchmarks. Usage:
+ *
+ *   mt_bench <benchmark> [max_threads]
+ *
+ * The benchmark is run with 1, 2, 4, ... threads up to max_threads, which
+ * defaults to the number of online CPUs, and then with max_threads itself
+ * if that is not a power of two. Each thread does the same amount of
+ * work, so perfect scaling keeps the time constant. Every thread count runs
+ * in a forked child so that its peak RSS is measured on its own, and the
+ * results are printed as one line of JSON per thread count.
+ */
+
+#define MAX_THREADS (256)
+
+typedef struct result {
+  /* malloc and free calls made by all threads */
+  uint64_t ops;
+  uint64_t elapsed_ns;
+
+  /* most bytes the benchmark can have allocated at once */
+  size_t live_bytes;
+
+  /* growth of the peak RSS while the benchmark ran */
+  long rss_growth_kb;
+} result;
+
+static pthread_barrier_t g_start_barrier;
+static int g_threads = 0;
+
+/*
+ * Starts count threads running fn, with their index as argument, and waits
+ * for them all to finish. Returns the time from the moment they were all
+ * ready to the moment the last one finished.
+ */
+
+static uint64_t run_threads(int count, void *(*fn)(void *)) {
+  pthread_t threads[MAX_THREADS];
+  pthread_barrier_init(&g_start_barrier, NULL, count + 1);
+  for (int i = 0; i < count; i++) {
+    pthread_create(&threads[i], NULL, fn, (void *) (intptr_t) i);
+  }
+  pthread_barrier_wait(&g_start_barrier);
+  uint64_t start = bench_now_ns();
+  for (int i = 0; i < count; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  uint64_t elapsed = bench_now_ns() - start;
+  pthread_barrier_destroy(&g_start_barrier);
+  return elapsed;
+} /* run_threads() */
+
+/*
+ * threadtest: every thread allocates a batch of objects and frees them all
+ * again, over and over. Nothing is shared between threads.
+ */
+
+#define THREADTEST_ROUNDS (100)
+#define THREADTEST_OBJECTS (10000)
+#define THREADTEST_SIZE (64)
+
+static void *threadtest_thread(void *arg) {
+  (void) arg;
+  void *objects[THREADTEST_OBJECTS];
+  pthread_barrier_wait(&g_start_barrier);
+  for (int round = 0; round < THREADTEST_ROUNDS; round++) {
+    for (int i = 0; i < THREADTEST_OBJECTS; i++) {
+      objects[i] = bench_malloc(THREADTEST_SIZE);
+      *((char *) objects[i]) = 1;
+    }
+    for (int i = 0; i < THREADTEST_OBJECTS; i++) {
+      bench_free(objects[i]);
+    }
+  }
+  return NULL;
+} /* threadtest_thread() */
+
+static void threadtest(result *r) {
+  r->elapsed_ns = run_threads(g_threads, threadtest_thread);
+  r->ops = 2ULL * THREADTEST_ROUNDS * THREADTEST_OBJECTS * g_threads;
+  r->live_bytes = ((size_t) THREADTEST_OBJECTS) * THREADTEST_SIZE * g_threads;
+} /* threadtest() */
+
+/*
+ * larson: every thread replaces random blocks of its own set of live
+ * blocks. After each round the threads exit and new ones take over the sets
+ * of their neighbors, so most blocks are freed by a different thread than
+ * the one that allocated them.
+ */
+
+#define LARSON_ROUNDS (10)
+#define LARSON_SLOTS (1000)
+#define LARSON_OPS (100000)
+#define LARSON_MIN_SIZE (16)
+#define LARSON_MAX_SIZE (1024)
+
+static void *g_larson_slots[MAX_THREADS][LARSON_SLOTS];
+static int g_larson_round = 0;
+
+static void *larson_thread(void *arg) {
+  int set = (((int) (intptr_t) arg) + g_larson_round) % g_threads;
+  void **slots = g_larson_slots[set];
+  uint64_t rng = 0x9e3779b97f4a7c15ULL + (intptr_t) arg;
+
+  pthread_barrier_wait(&g_start_barrier);
+  for (int i = 0; i < LARSON_OPS; i++) {
+    uint64_t r = bench_random(&rng);
+    size_t slot = r % LARSON_SLOTS;
+    bench_free(slots[slot]);
+    slots[slot] = bench_malloc(LARSON_MIN_SIZE + ((r >> 32) %
+                               (LARSON_MAX_SIZE - LARSON_MIN_SIZE + 1)));
+    *((char *) slots[slot]) = 1;
+  }
+  return NULL;
+} /* larson_thread() */
+
+static void larson(result *r) {
+  for (int set = 0; set < g_threads; set++) {
+    for (int slot = 0; slot < LARSON_SLOTS; slot++) {
+      g_larson_slots[set][slot] = bench_malloc(LARSON_MIN_SIZE);
+    }
+  }
+
+  r->elapsed_ns = 0;
+  for (g_larson_round = 0; g_larson_round < LARSON_ROUNDS; g_larson_round++) {
+    r->elapsed_ns += run_threads(g_threads, larson_thread);
+  }
+  r->ops = 2ULL * LARSON_ROUNDS * LARSON_OPS * g_threads;
+  r->live_bytes = ((size_t) LARSON_SLOTS) * LARSON_MAX_SIZE * g_threads;
+
+  for (int set = 0; set < g_threads; set++) {
+    for (int slot = 0; slot < LARSON_SLOTS; slot++) {
+      bench_free(g_larson_slots[set][slot]);
+    }
+  }
+} /* larson() */
+
+/*
+ * xmalloc: every thread allocates blocks and passes them through a ring to
+ * its neighbor, which frees them. With one thread, the thread frees its own
+ * blocks.
+ */
+
+#define XMALLOC_OBJECTS (1000000)
+#define XMALLOC_RING_SIZE (1024)
+#define XMALLOC_MAX_SIZE (512)
+
+typedef struct ring {
+  void *slots[XMALLOC_RING_SIZE];
+
+  /* next slot to pop, only written by the consumer */
+  size_t head __attribute__((aligned(64)));
+
+  /* next slot to push, only written by the producer */
+  size_t tail __attribute__((aligned(64)));
+
+  /* set by the producer once it has pushed its last block */
+  bool done;
+} ring;
+
+static ring g_rings[MAX_THREADS];
+
+static void *xmalloc_thread(void *arg) {
+  int index = (int) (intptr_t) arg;
+  ring *out = &g_rings[index];
+  ring *in = &g_rings[(index + 1) % g_threads];
+  uint64_t rng = 0x9e3779b97f4a7c15ULL + index;
+  size_t produced = 0;
+
+  pthread_barrier_wait(&g_start_barrier);
+  while (true) {
+    bool progress = false;
+
+    if (produced < XMALLOC_OBJECTS) {
+      size_t tail = out->tail;
+      if (tail - __atomic_load_n(&out->head, __ATOMIC_ACQUIRE) <
+          XMALLOC_RING_SIZE) {
+        char *p = bench_malloc(16 + (bench_random(&rng) %
+                                     (XMALLOC_MAX_SIZE - 15)));
+        p[0] = 1;
+        out->slots[tail % XMALLOC_RING_SIZE] = p;
+        __atomic_store_n(&out->tail, tail + 1, __ATOMIC_RELEASE);
+        produced++;
+        progress = true;
+        if (produced == XMALLOC_OBJECTS) {
+          __atomic_store_n(&out->done, true, __ATOMIC_RELEASE);
+        }
+      }
+    }
+
+    bool in_done = __atomic_load_n(&in->done, __ATOMIC_ACQUIRE);
+    size_t head = in->head;
+    if (head != __atomic_load_n(&in->tail, __ATOMIC_ACQUIRE)) {
+      bench_free(in->slots[head % XMALLOC_RING_SIZE]);
+      __atomic_store_n(&in->head, head + 1, __ATOMIC_RELEASE);
+      progress = true;
+    }
+    else if (in_done && (produced == XMALLOC_OBJECTS)) {
+      break;
+    }
+
+    if (!progress) {
+      sched_yield();
+    }
+  }
+  return NULL;
+} /* xmalloc_thread() */
+
+static void xmalloc(result *r) {
+  r->elapsed_ns = run_threads(g_threads, xmalloc_thread);
+  r->ops = 2ULL * XMALLOC_OBJECTS * g_threads;
+  r->live_bytes = ((size_t) XMALLOC_RING_SIZE) * XMALLOC_MAX_SIZE * g_threads;
+} /* xmalloc() */
+
+/*
+ * cache-scratch: the main thread allocates one small object per thread, so
+ * they likely share cache lines. Each thread frees its object and then keeps
+ * allocating, writing and freeing objects of the same size. An allocator
+ * that hands the same cache line to different threads makes the writes
+ * bounce the line between cores.
+ */
+
+#define SCRATCH_ITERATIONS (10000)
+#define SCRATCH_WRITES (1000)
+#define SCRATCH_SIZE (8)
+
+static char *g_scratch_objects[MAX_THREADS];
+
+static void *scratch_thread(void *arg) {
+  int index = (int) (intptr_t) arg;
+  pthread_barrier_wait(&g_start_barrier);
+
+  bench_free(g_scratch_objects[index]);
+  for (int i = 0; i < SCRATCH_ITERATIONS; i++) {
+    volatile char *p = bench_malloc(SCRATCH_SIZE);
+    for (int write = 0; write < SCRATCH_WRITES; write++) {
+      p[write % SCRATCH_SIZE]++;
+    }
+    bench_free((char *) p);
+  }
+  return NULL;
+} /* scratch_thread() */
+
+static void cache_scratch(result *r) {
+  for (int i = 0; i < g_threads; i++) {
+    g_scratch_objects[i] = bench_malloc(SCRATCH_SIZE);
+  }
+  r->elapsed_ns = run_threads(g_threads, scratch_thread);
+  r->ops = 2ULL * SCRATCH_ITERATIONS * g_threads;
+
+  /* a few live bytes are too few for the blowup to mean anything */
+  r->live_bytes = 0;
+} /* cache_scratch() */
+
+typedef struct benchmark {
+  const char *name;
+  void (*run)(result *r);
+} benchmark;
+
+static const benchmark g_benchmarks[] = {
+  { "threadtest", threadtest },
+  { "larson", larson },
+  { "xmalloc", xmalloc },
+  { "cache-scratch", cache_scratch },
+};
+
+#define BENCHMARK_COUNT (sizeof(g_benchmarks) / sizeof(g_benchmarks[0]))
+
+/*
+ * Runs the benchmark with the given number of threads in a child process.
+ * Returns false if the child failed.
+ */
+
+static bool run_child(const benchmark *b, int threads, result *r) {
+  int fds[2];
+  if (pipe(fds) != 0) {
+    return false;
+  }
+
+  pid_t pid = fork();
+  if (pid == 0) {
+    close(fds[0]);
+    g_threads = threads;
+    long rss_before = bench_peak_rss_kb();
+    b->run(r);
+    r->rss_growth_kb = bench_peak_rss_kb() - rss_before;
+    _exit(write(fds[1], r, sizeof(*r)) == sizeof(*r) ? 0 : 1);
+  }
+
+  close(fds[1]);
+  bool ok = (pid > 0) && (read(fds[0], r, sizeof(*r)) == sizeof(*r));
+  close(fds[0]);
+
+  int status = 0;
+  if ((pid > 0) && ((waitpid(pid, &status, 0) != pid) ||
+                    !WIFEXITED(status) || (WEXITSTATUS(status) != 0))) {
+    ok = false;
+  }
+  return ok;
+} /* run_child() */
+
+/*
+ * Runs benchmark b with the given number of threads and prints its result
+ * as one JSON line. The run with one thread sets *single_thread_rate, which
+ * the scaling efficiency of the later runs is measured against. Returns
+ * false if the run failed.
+ */
+
+static bool run_and_report(const benchmark *b, long threads,
+                           double *single_thread_rate) {
+  result r;
+  memset(&r, 0, sizeof(r));
+  if (!run_child(b, (int) threads, &r)) {
+    fprintf(stderr, "mt_bench: %s failed with %ld threads\n", b->name,
+            threads);
+    return false;
+  }
+
+  double rate = r.ops / (r.elapsed_ns / 1e9);
+  if (threads == 1) {
+    *single_thread_rate = rate;
+  }
+  printf("{\"commit\": \"%s\", \"allocator\": \"%s\", \"fit\": %d, "
+         "\"benchmark\": \"%s\", \"threads\": %ld, \"ops\": %llu, "
+         "\"ops_per_sec\": %.0f, \"scaling_efficiency\": %.3f, "
+         "\"live_bytes\": %zu, \"rss_growth_kb\": %ld, ",
+         BENCH_COMMIT, BENCH_ALLOCATOR, BENCH_FIT, b->name, threads,
+         (unsigned long long) r.ops, rate,
+         rate / (threads * *single_thread_rate), r.live_bytes,
+         r.rss_growth_kb);
+  if (r.live_bytes == 0) {
+    printf("\"blowup\": null}\n");
+  }
+  else {
+    printf("\"blowup\": %.3f}\n", (r.rss_growth_kb * 1024.0) / r.live_bytes);
+  }
+  return true;
+} /* run_and_report() */
+
+int main(int argc, char **argv) {
+  if (argc < 2) {
+    fprintf(stderr, "usage: %s <benchmark> [max_threads]\n", argv[0]);
+    return 2;
+  }
+
+  const benchmark *b = NULL;
+  for (size_t i = 0; i < BENCHMARK_COUNT; i++) {
+    if (strcmp(argv[1], g_benchmarks[i].name) == 0) {
+      b = &g_benchmarks[i];
+    }
+  }
+  if (b == NULL) {
+    fprintf(stderr, "mt_bench: unknown benchmark %s\n", argv[1]);
+    return 2;
+  }
+
+  long max_threads = (argc > 2) ? atol(argv[2]) :
+                     sysconf(_SC_NPROCESSORS_ONLN);
+  if (max_threads < 1) {
+    max_threads = 1;
+  }
+  if (max_threads > MAX_THREADS) {
+    max_threads = MAX_THREADS;
+  }
+
+  double single_thread_rate = 0;
+  long threads = 1;
+  for (; threads <= max_threads; threads *= 2) {
+    if (!run_and_report(b, threads, &single_thread_rate)) {
+      return 1;
+    }
+  }
+
+  /* always end the sweep at max_threads */
+  if (threads / 2 != max_threads) {
+    if (!run_and_report(b, max_threads, &single_thread_rate)) {
+      return 1;
+    }
+  }
+  return 0;
+} /* main() */
@@ -0,0 +1,153 @@
+#include <linux/perf_event.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "bench.h"
+
+/*
+ * Pointer chasing over a large heap, for comparing the dTLB misses of the
+ * normal arenas with the huge page backed ones. Usage:
+ *
+ *   MALLOC_HUGEPAGES=0|1 tlb_bench [nodes] [passes]
+ *
+ * The nodes are allocated in order and linked in a random order, so every
+ * step of the walk lands on a different page. The walk is timed and its
+ * dTLB read misses are counted with perf_event_open(), or reported as null
+ * where the kernel doesn't allow it. The results are printed as a single
+ * line of JSON.
+ */
+
+#define DEFAULT_NODES (1 << 20)
+#define DEFAULT_PASSES (4)
+
+/* Bigger than the slab sizes, so the nodes come from the arenas */
+#define NODE_SIZE (256)
+
+typedef struct node {
+  struct node *next;
+  char payload[NODE_SIZE - sizeof(struct node *)];
+} node;
+
+/*
+ * Opens a counter for the calling thread's dTLB read misses. Returns -1 if
+ * the kernel doesn't have one or won't let us use it.
+ */
+
+static int open_dtlb_counter(void) {
+  struct perf_event_attr attr;
+  memset(&attr, 0, sizeof(attr));
+  attr.size = sizeof(attr);
+  attr.type = PERF_TYPE_HW_CACHE;
+  attr.config = PERF_COUNT_HW_CACHE_DTLB |
+                (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+  attr.disabled = 1;
+  attr.exclude_kernel = 1;
+  attr.exclude_hv = 1;
+  return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+} /* open_dtlb_counter() */
+
+/*
+ * Returns how many KiB of the heap ended up on huge pages, from the
+ * AnonHugePages line of /proc/self/smaps_rollup, or -1 if it can't tell.
+ */
+
+static long anon_huge_kb(void) {
+  FILE *f = fopen("/proc/self/smaps_rollup", "r");
+  if (f == NULL) {
+    return -1;
+  }
+  char line[256];
+  long kb = -1;
+  while (fgets(line, sizeof(line), f) != NULL) {
+    if (sscanf(line, "AnonHugePages: %ld kB", &kb) == 1) {
+      break;
+    }
+  }
+  fclose(f);
+  return kb;
+} /* anon_huge_kb() */
+
+int main(int argc, char **argv) {
+  size_t count = (argc > 1) ? strtoul(argv[1], NULL, 0) : DEFAULT_NODES;
+  size_t passes = (argc > 2) ? strtoul(argv[2], NULL, 0) : DEFAULT_PASSES;
+  if ((count == 0) || (passes == 0)) {
+    fprintf(stderr, "usage: %s [nodes] [passes]\n", argv[0]);
+    return 2;
+  }
+
+  node **nodes = malloc(count * sizeof(node *));
+  if (nodes == NULL) {
+    fprintf(stderr, "tlb_bench: out of memory\n");
+    return 1;
+  }
+  for (size_t i = 0; i < count; i++) {
+    nodes[i] = bench_malloc(sizeof(node));
+    if (nodes[i] == NULL) {
+      fprintf(stderr, "tlb_bench: out of memory\n");
+      return 1;
+    }
+  }
+
+  /* link the nodes into one cycle in a random order */
+  uint64_t rng = 0x9e3779b97f4a7c15ULL;
+  for (size_t i = count - 1; i > 0; i--) {
+    size_t j = bench_random(&rng) % (i + 1);
+    node *swap = nodes[i];
+    nodes[i] = nodes[j];
+    nodes[j] = swap;
+  }
+  for (size_t i = 0; i < count; i++) {
+    nodes[i]->next = nodes[(i + 1) % count];
+  }
+
+  int counter = open_dtlb_counter();
+  if (counter >= 0) {
+    ioctl(counter, PERF_EVENT_IOC_RESET, 0);
+    ioctl(counter, PERF_EVENT_IOC_ENABLE, 0);
+  }
+  uint64_t start = bench_now_ns();
+  node *n = nodes[0];
+  for (size_t step = 0; step < count * passes; step++) {
+    n = n->next;
+  }
+  uint64_t elapsed = bench_now_ns() - start;
+  long long misses = -1;
+  if (counter >= 0) {
+    ioctl(counter, PERF_EVENT_IOC_DISABLE, 0);
+    if (read(counter, &misses, sizeof(misses)) != sizeof(misses)) {
+      misses = -1;
+    }
+    close(counter);
+  }
+
+  /* keep the walk from being optimized away */
+  if (n == NULL) {
+    return 1;
+  }
+
+  const char *huge_env = getenv("MALLOC_HUGEPAGES");
+  printf("{\"commit\": \"%s\", \"allocator\": \"%s\", \"hugepages\": %d, "
+         "\"nodes\": %zu, \"accesses\": %zu, \"ns_per_access\": %.2f, "
+         "\"anon_huge_kb\": %ld, ",
+         BENCH_COMMIT, BENCH_ALLOCATOR,
+         (huge_env != NULL) && (atoi(huge_env) != 0), count, count * passes,
+         ((double) elapsed) / (count * passes), anon_huge_kb());
+  if (misses < 0) {
+    printf("\"dtlb_misses\": null}\n");
+  }
+  else {
+    printf("\"dtlb_misses\": %lld}\n", misses);
+  }
+
+  for (size_t i = 0; i < count; i++) {
+    bench_free(nodes[i]);
+  }
+  free(nodes);
+  return 0;
+} /* main() */
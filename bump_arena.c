@@ -0,0 +1,241 @@
+#include <my_malloc.h>
+#include <my_malloc_ext.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Bump arenas for allocations that all die at the same time, like the ones
+ * made while serving a request. An arena hands out memory by moving a
+ * cursor through a block it got from my_malloc(), and takes a bigger block
+ * when the current one fills up. Nothing is ever freed on its own:
+ * my_arena_reset() moves the cursor back to the first block so the same
+ * blocks serve the next request, and my_arena_destroy() gives them all back
+ * to the heap with one my_free_batch().
+ *
+ * An arena is not locked, so only one thread may use it at a time.
+ */
+
+/* Alignment of an allocation when the caller asks for none */
+#define BUMP_ALIGNMENT (16)
+
+/* Smallest block an arena takes from the heap, and the size growth stops */
+/* doubling at */
+#define BUMP_BLOCK_MIN ((size_t) 4096)
+#define BUMP_BLOCK_MAX ((size_t) 1024 * 1024)
+
+/* Blocks handed to each my_free_batch() call by my_arena_destroy() */
+#define BUMP_FREE_BATCH (64)
+
+/*
+ * Header of each block an arena takes from the heap, followed by size
+ * bytes for allocations. It is 16 bytes, so the space after it is as
+ * aligned as my_malloc()'s blocks are.
+ */
+
+typedef struct bump_block {
+  struct bump_block *next;
+  size_t size;
+} bump_block;
+
+struct bump_arena {
+  /* The arena's blocks in the order they are used, and the one being */
+  /* allocated from. Blocks after current are kept for after a reset. */
+  bump_block *first;
+  bump_block *current;
+
+  /* Next free byte of current and the end of it */
+  char *cursor;
+  char *limit;
+
+  /* Size of the next block taken from the heap */
+  size_t next_size;
+};
+
+/*
+ * Returns the space for allocations in block b.
+ */
+
+static inline char *block_data(bump_block *b) {
+  return (char *) (b + 1);
+} /* block_data() */
+
+/*
+ * Starts allocating from the beginning of block b.
+ */
+
+static inline void use_block(bump_arena *a, bump_block *b) {
+  a->current = b;
+  a->cursor = block_data(b);
+  a->limit = a->cursor + b->size;
+} /* use_block() */
+
+/*
+ * Takes a block with room for size bytes from the heap. Returns NULL with
+ * errno set to ENOMEM if there is no memory for it.
+ */
+
+static bump_block *new_block(size_t size) {
+  if (size > SIZE_MAX - sizeof(bump_block)) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  bump_block *b = my_malloc(sizeof(bump_block) + size);
+  if (b == NULL) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  b->next = NULL;
+  b->size = size;
+  return b;
+} /* new_block() */
+
+/*
+ * Creates an arena whose first block has room for initial_size bytes, or
+ * BUMP_BLOCK_MIN if that is more. Returns NULL with errno set to ENOMEM if
+ * there is no memory for it.
+ */
+
+bump_arena *my_arena_create(size_t initial_size) {
+  if (initial_size < BUMP_BLOCK_MIN) {
+    initial_size = BUMP_BLOCK_MIN;
+  }
+
+  bump_arena *a = my_malloc(sizeof(bump_arena));
+  if (a == NULL) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  bump_block *b = new_block(initial_size);
+  if (b == NULL) {
+    my_free(a);
+    return NULL;
+  }
+
+  a->first = b;
+  use_block(a, b);
+
+  /* the next block doubles this one, unless this one is already big */
+  a->next_size = initial_size;
+  if (initial_size < BUMP_BLOCK_MAX) {
+    a->next_size = (initial_size < BUMP_BLOCK_MAX / 2) ? 2 * initial_size :
+                                                         BUMP_BLOCK_MAX;
+  }
+  return a;
+} /* my_arena_create() */
+
+/*
+ * Moves arena a on to a block with room for size bytes at the given
+ * alignment and allocates them there. The blocks kept by a reset are used
+ * first, in order, and one too small for the request is passed over until
+ * the next reset. Otherwise a new block is taken from the heap, twice as
+ * big as the last one up to BUMP_BLOCK_MAX, or just big enough for a larger
+ * request.
+ */
+
+static void *bump_alloc_slow(bump_arena *a, size_t size, size_t alignment) {
+  /* block data is BUMP_ALIGNMENT aligned, so only stricter alignments */
+  /* can need padding */
+  size_t needed = size;
+  if (alignment > BUMP_ALIGNMENT) {
+    if (size > SIZE_MAX - alignment) {
+      errno = ENOMEM;
+      return NULL;
+    }
+    needed += alignment - BUMP_ALIGNMENT;
+  }
+
+  bump_block *b = a->current->next;
+  while ((b != NULL) && (b->size < needed)) {
+    b = b->next;
+  }
+
+  if (b == NULL) {
+    size_t block_size = a->next_size;
+    if (block_size < needed) {
+      block_size = needed;
+    }
+    else if (a->next_size < BUMP_BLOCK_MAX) {
+      a->next_size = (a->next_size < BUMP_BLOCK_MAX / 2) ?
+                     2 * a->next_size : BUMP_BLOCK_MAX;
+    }
+
+    b = new_block(block_size);
+    if (b == NULL) {
+      return NULL;
+    }
+
+    /* the kept blocks after current stay in line for the next reset */
+    b->next = a->current->next;
+    a->current->next = b;
+  }
+
+  use_block(a, b);
+  char *p = a->cursor + ((-(uintptr_t) a->cursor) & (alignment - 1));
+  a->cursor = p + size;
+  return p;
+} /* bump_alloc_slow() */
+
+/*
+ * Allocates size bytes from arena a at an address that is a multiple of
+ * alignment, a power of two, or of BUMP_ALIGNMENT if alignment is 0. The
+ * memory stays valid until the arena is reset or destroyed. Sets errno to
+ * EINVAL and returns NULL for any other alignment, and to ENOMEM if there
+ * is no memory left.
+ */
+
+void *my_arena_alloc(bump_arena *a, size_t size, size_t alignment) {
+  if (alignment == 0) {
+    alignment = BUMP_ALIGNMENT;
+  }
+  if ((alignment & (alignment - 1)) != 0) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  /* the common case: bump the cursor within the current block */
+  size_t padding = (-(uintptr_t) a->cursor) & (alignment - 1);
+  size_t available = a->limit - a->cursor;
+  if ((padding <= available) && (size <= available - padding)) {
+    char *p = a->cursor + padding;
+    a->cursor = p + size;
+    return p;
+  }
+
+  return bump_alloc_slow(a, size, alignment);
+} /* my_arena_alloc() */
+
+/*
+ * Frees everything allocated from arena a at once. Its blocks are kept and
+ * used again, starting from the first, by the allocations that follow.
+ */
+
+void my_arena_reset(bump_arena *a) {
+  use_block(a, a->first);
+} /* my_arena_reset() */
+
+/*
+ * Frees everything allocated from arena a and the arena itself, giving its
+ * blocks back to the heap with my_free_batch().
+ */
+
+void my_arena_destroy(bump_arena *a) {
+  if (a == NULL) {
+    return;
+  }
+
+  void *batch[BUMP_FREE_BATCH];
+  size_t count = 0;
+  batch[count++] = a;
+  bump_block *b = a->first;
+  while (b != NULL) {
+    bump_block *next = b->next;
+    batch[count++] = b;
+    if (count == BUMP_FREE_BATCH) {
+      my_free_batch(batch, count);
+      count = 0;
+    }
+    b = next;
+  }
+  my_free_batch(batch, count);
+} /* my_arena_destroy() */
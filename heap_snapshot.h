@@ -0,0 +1,62 @@
+#ifndef HEAP_SNAPSHOT_H
+#define HEAP_SNAPSHOT_H
+
+#include <stdint.h>
+
+/*
+ * File format written by my_malloc_snapshot() and read by tools/heapmap.
+ * A snapshot is a heap_snapshot_header followed by block_count
+ * heap_snapshot_block records, one per block of every arena chunk in
+ * address order, fenceposts included so chunk boundaries can be seen.
+ * Everything is in the byte order of the machine that wrote it.
+ *
+ * Blocks that are allocated but sitting in an arena's fastbins or remote
+ * free queue are marked HEAP_BLOCK_CACHED, since consolidation would turn
+ * them back into free memory. Blocks in other threads' caches can't be
+ * seen and show up as allocated. Slabs and mapped blocks are not part of
+ * any chunk and are only counted in the header.
+ */
+
+#define HEAP_SNAPSHOT_MAGIC "MMHEAP01"
+
+typedef struct heap_snapshot_header {
+  char magic[8];
+  uint64_t block_count;
+  uint64_t page_size;
+
+  /* Bytes of each block taken by its header */
+  uint64_t header_size;
+
+  /* Bytes of mapped blocks, and of slabs in use and taken from the OS */
+  uint64_t mmapped_bytes;
+  uint64_t slab_bytes_in_use;
+  uint64_t slab_bytes;
+
+  uint32_t arena_count;
+  uint32_t reserved;
+} heap_snapshot_header;
+
+/*
+ * Each block is two words: the address of its header with the arena index
+ * and state packed into the unused top 16 bits, and its size including the
+ * header.
+ */
+
+typedef struct heap_snapshot_block {
+  uint64_t address;
+  uint64_t size;
+} heap_snapshot_block;
+
+#define HEAP_BLOCK_FREE (0)
+#define HEAP_BLOCK_ALLOCATED (1)
+#define HEAP_BLOCK_FENCEPOST (2)
+#define HEAP_BLOCK_CACHED (3)
+
+#define HEAP_BLOCK_PACK(address, arena, state) \
+  (((uint64_t) (address)) | (((uint64_t) (arena)) << 48) | \
+   (((uint64_t) (state)) << 56))
+#define HEAP_BLOCK_ADDRESS(b) ((b)->address & ((1ULL << 48) - 1))
+#define HEAP_BLOCK_ARENA(b) (((b)->address >> 48) & 0xff)
+#define HEAP_BLOCK_STATE(b) ((b)->address >> 56)
+
+#endif // HEAP_SNAPSHOT_H
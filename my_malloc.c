@@ -1,36 +1,157 @@
+#define _GNU_SOURCE
+
 #include <my_malloc.h>
+#include <my_malloc_ext.h>
 #include <printing.h>
+#include <arena.h>
+#include <slab.h>
+#include <profile.h>
+#include <heap_snapshot.h>
 #include <pthread.h>
 #include <unistd.h>
+#include <sys/mman.h>
 #include <stdio.h>
 #include <assert.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
 #include <errno.h>
+#include <time.h>
+#include <fcntl.h>
 
-/* Pointer to the location of the heap prior to any sbrk calls */
+/* Start of the heap: the program break before any sbrk calls, or the */
+/* start of the first range reserved for an arena */
 void *g_base = NULL;
 
-/* Pointer to the head of the free list */
-header *g_freelist_head = NULL;
+/* The arenas, each with its own freelist and lock */
+arena g_arenas[MAX_ARENAS];
+
+/* Number of arenas in use */
+int g_arena_count = 1;
+
+/* Index of the arena the next new thread will be assigned to */
+static unsigned int g_next_arena_index = 0;
+
+/* Arena the calling thread allocates from */
+static __thread arena *g_thread_arena = NULL;
+
+/* Mutex that serializes growing and shrinking the heap on behalf of */
+/* different arenas */
+static pthread_mutex_t g_heap_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Size of a page of memory, chunks from the OS are page aligned */
+static size_t g_page_size = 4096;
+
+/* Block size at and above which blocks are mapped directly from the OS */
+static size_t g_mmap_threshold = MMAP_THRESHOLD;
+
+/* Free block size above which memory is given back to the OS on free */
+static size_t g_trim_threshold = TRIM_THRESHOLD;
 
-/* Mutex to ensure thread safety for the freelist */
-static pthread_mutex_t g_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* Address space each arena reserves at a time */
+static size_t g_heap_reserve = HEAP_RESERVE_SIZE;
+
+/* Bounds on how much an arena grows by at a time */
+static size_t g_grow_min = GROW_MIN;
+static size_t g_grow_max = GROW_MAX;
+
+/* Whether the arenas use huge pages, and in the HEAP_SBRK build what is */
+/* left of the current huge page region. Only changed with g_heap_mutex */
+/* held, or by init. */
+static bool g_huge_pages = false;
+#ifdef HEAP_SBRK
+static char *g_huge_next = NULL;
+static char *g_huge_end = NULL;
+#endif
+
+/*
+ * Map from page address to the arena that owns the page, stored as the
+ * arena's index plus one so that zero means the page is not part of any
+ * arena. It is a two level radix table over the 48 bit address space: the
+ * root is a static array and each leaf, covering CHUNK_MAP_LEAF_SIZE pages,
+ * is mapped from the OS the first time a chunk lands in its range. Reads
+ * do not take any lock.
+ */
+
+#define CHUNK_MAP_PAGE_SHIFT (12)
+#define CHUNK_MAP_LEAF_BITS (18)
+#define CHUNK_MAP_ROOT_BITS (48 - CHUNK_MAP_PAGE_SHIFT - CHUNK_MAP_LEAF_BITS)
+#define CHUNK_MAP_LEAF_SIZE ((size_t) 1 << CHUNK_MAP_LEAF_BITS)
+
+static uint8_t *g_chunk_map[(size_t) 1 << CHUNK_MAP_ROOT_BITS];
 
 /*
- * Pointer to the second fencepost in the most recently allocated chunk from
- * the OS. Used for coalescing chunks
+ * Per-thread cache of recently freed blocks, binned by block size. Small
+ * mallocs and frees are served from here without taking any lock; the cache
+ * is refilled from and flushed to the freelist in batches of TCACHE_BATCH
+ * blocks. Cached blocks stay marked ALLOCATED and are linked through their
+ * next pointers. Setting TCACHE_MAX_SIZE to 0 disables the cache.
  */
 
-header *g_last_fence_post = NULL;
+#ifndef TCACHE_MAX_SIZE
+#define TCACHE_MAX_SIZE (256)
+#endif
+
+#ifndef TCACHE_MAX_BYTES
+#define TCACHE_MAX_BYTES (64 * 1024)
+#endif
+
+#define TCACHE_BATCH (8)
+#define TCACHE_BIN_MAX (4 * TCACHE_BATCH)
+#define TCACHE_BIN_COUNT ((TCACHE_MAX_SIZE / MIN_ALLOCATION) + 1)
+
+typedef struct tcache {
+  header *bins[TCACHE_BIN_COUNT];
+  unsigned int counts[TCACHE_BIN_COUNT];
+  size_t bytes;
+  bool registered;
+} tcache;
+
+static __thread tcache g_tcache;
+
+/* Key whose destructor drains a thread's cache when the thread exits */
+static pthread_key_t g_tcache_key;
 
 /*
- * Pointer to the next block in the freelist after the block that was last
- * allocated. If the block pointed to is removed by coalescing, this shouuld be
- * updated to point to the next block after the removed block.
+ * Counters behind my_malloc_stats() that change on every call. Each thread
+ * updates its own copy with relaxed atomic loads and stores, which compile
+ * to plain moves, so that my_malloc_stats() can sum them from another thread
+ * without making the allocation paths share a cache line. Byte counts are
+ * kept by the arenas and slabs under the locks they already take. Setting
+ * MALLOC_STATS to 0 compiles the counting out.
  */
-header *g_next_allocate = NULL;
+
+#ifndef MALLOC_STATS
+#define MALLOC_STATS (1)
+#endif
+
+typedef struct thread_stats {
+  uint64_t lock_wait_ns;
+  uint64_t allocations[MALLOC_STATS_CLASS_COUNT];
+  struct thread_stats *next;
+  struct thread_stats *prev;
+  bool registered;
+} thread_stats;
+
+static __thread thread_stats g_thread_stats;
+
+/* Counters of all live threads, and the totals of threads that exited */
+static thread_stats *g_stats_threads = NULL;
+static thread_stats g_stats_retired;
+static pthread_mutex_t g_stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Key whose destructor folds a thread's counters into g_stats_retired */
+static pthread_key_t g_stats_key;
+
+/* Calls that grew or shrank the arenas' heaps and the bytes they hold, */
+/* only changed with g_heap_mutex held */
+static size_t g_sbrk_calls = 0;
+static size_t g_sbrk_bytes = 0;
+
+/* Blocks mapped directly from the OS, updated with relaxed atomics */
+static size_t g_mmap_calls = 0;
+static size_t g_mmapped_bytes = 0;
 
 /*
  * Direct the compiler to run the init function before running main
@@ -39,150 +160,69 @@ header *g_next_allocate = NULL;
 
 static void init(void) __attribute__((constructor));
 
+/*
+ * Set once init() has run. Other libraries' constructors can allocate
+ * before ours runs when the allocator is preloaded, so the entry points
+ * call init() themselves until then.
+ */
+
+static bool g_initialized = false;
+static pthread_once_t g_init_once = PTHREAD_ONCE_INIT;
+
 /*
  * Direct the compiler to ignore unused static functions.
  */
 static void set_fenceposts(void *mem, size_t size) __attribute__((unused));
-static void insert_free_block(header *h) __attribute__((unused));
-static header *find_header(size_t size) __attribute__((unused));
+static void insert_free_block(arena *a, header *h) __attribute__((unused));
+static void remove_free_block(arena *a, header *h);
+static header *allocate_block(arena *a, header *h, size_t size);
+static header *find_header(arena *a, size_t size) __attribute__((unused));
+static bool consolidate_fastbins(arena *a);
+static header *address_fit(arena *a, uintptr_t start, uintptr_t end,
+                           size_t size);
+static void drain_remote_frees(arena *a);
+static void adapt_fit(arena *a);
 
 /*
- * Allocate the first available block able to satisfy the request
- * (starting the search at g_freelist_head)
+ * Returns true if arena a keeps its free blocks in the address ordered
+ * tree, which only the list based policies use.
  */
 
-static header *first_fit(size_t size_requested) {
-  /* try to find the block. if found, 
-  return a pointer to the header of that block. if not found,
-  return NULL */
-  if (g_freelist_head == NULL) {
-    return NULL;
-  }
-  
-  header *current_header = g_freelist_head;
-  bool block_found = false;
-  while (!block_found) {
-    
-    /* if the size is exactly correct, simply remove this block from the free list */
-    if (TRUE_SIZE(current_header) == size_requested) {
-      if ((current_header->size & 0b111) == ((state) ALLOCATED)) {
-        if (current_header->next == NULL) {
-          return NULL;
-        }
-        else {
-          current_header = current_header->next;
-          continue;
-        }
-      }
-      /* play with pointers to maintain the integrity of the list */
-      /* if this is the head, check if there is a next block */
-      if (current_header == g_freelist_head) {
-        if (current_header->next != NULL) {
-          g_freelist_head = current_header->next;
-          current_header->next = NULL;
-          current_header->next->prev = NULL;
-        }
-      }
-      /* if this isn't the head block, we know the prev isn't null */
-      else {
-        /* if the next block is NULL, this takes care of that case as well */
-        (current_header->prev)->next = current_header->next;
-        if (current_header->next != NULL) {
-          (current_header->next)->prev = current_header->prev;
-        }
-      }
-         
-      /* now that we've fixed the pointers, */
-      /* take the block out of the free list */
-      current_header->size |= (state) ALLOCATED;
-
-      return current_header;
-    }
-    else if (TRUE_SIZE(current_header) > size_requested) {
-
-      /* determine what must be left over to split the block */
-      int size_leftover_to_split = 2 * ALLOC_HEADER_SIZE; 
-      if (MIN_ALLOCATION >= ALLOC_HEADER_SIZE) {
-        size_leftover_to_split += ALLOC_HEADER_SIZE;
-      }
-
-      /* if the leftover data is large enough for another block, */
-      /* split the block */
-      if ((TRUE_SIZE(current_header) - size_requested - ALLOC_HEADER_SIZE) >=
-         size_leftover_to_split) {
-        
-        /* split off the leftover block from the newly allocated block */
-        header *new_block = ((header *)(((char *) current_header) + 
-                            size_requested + ALLOC_HEADER_SIZE));
-        new_block->size = current_header->size - size_requested - ALLOC_HEADER_SIZE;
-        new_block->size |= (state) UNALLOCATED;
-
-        current_header->size -= (TRUE_SIZE(new_block) + ALLOC_HEADER_SIZE); 
-        current_header->size |= (state) ALLOCATED;
-
-        new_block->left_size = TRUE_SIZE(current_header);
-
-        header *to_return = current_header;
-
-        /* set the left_size of the block after the new block correctly */
-        header *new_blocks_right_neighbor = (header *) (((char *) new_block) + ALLOC_HEADER_SIZE + TRUE_SIZE(new_block));
-        new_blocks_right_neighbor->left_size = TRUE_SIZE(new_block);
-
-        /* remove the current block from the freelist */
-        if (current_header == g_freelist_head) {
-          if (current_header->next == NULL) {
-            g_freelist_head = NULL;
-          }
-          else {
-            g_freelist_head = current_header->next;
-            g_freelist_head->prev = NULL;
-          }
-        }
-
-        insert_free_block(new_block);
-        /* return this newly allocated block */
-        return to_return;
-      }
-      /* if the leftover data is not large enough, just allocate this */
-      /* whole block */
-      else {
-        /* play with pointers to maintain the free list */
+static inline bool is_address_ordered(arena *a) {
+  return a->address_ordered && (a->fit != 3) && (a->fit != 5);
+} /* is_address_ordered() */
 
-        /* if this is the head, check if there is a next block */
-        if (current_header == g_freelist_head) {
-          if (current_header->next != NULL) {
-            g_freelist_head = current_header->next;
-          }
-        }
-        /* if this isn't the head block, we know the prev isn't null */
-        else {
-          /* if the next block is NULL, this takes care of that case as well */
-          (current_header->prev)->next = current_header->next;
-        }
-
-        /* allocate the whole block */
-        current_header->size |= (state) ALLOCATED;
+/*
+ * Allocate the first available block able to satisfy the request
+ * (starting the search at a->freelist_head, or at the lowest address in an
+ * address ordered arena)
+ */
 
-        return current_header;
-      }
+static header *first_fit(arena *a, size_t size_requested) {
+  if (is_address_ordered(a)) {
+    header *found = address_fit(a, 0, UINTPTR_MAX, size_requested);
+    if (found != NULL) {
+      allocate_block(a, found, size_requested);
     }
-    else if (TRUE_SIZE(current_header) < size_requested) {
-      /* look for the next block since this isn't big enough */
+    return found;
+  }
 
-      /* if the next block is NULL, just return NULL */
-      if (current_header->next == NULL) {
-        return NULL;
-      }
-      /* otherwise, increment to the next block and check that */
-      else {
-        current_header = current_header->next;
-      }
+  /* try to find the block. if found,
+  return a pointer to the header of that block. if not found,
+  return NULL */
+  header *current_header = a->freelist_head;
+  while (current_header != NULL) {
+    if (TRUE_SIZE(current_header) >= size_requested) {
+      allocate_block(a, current_header, size_requested);
+      return current_header;
     }
 
+    /* look for the next block since this isn't big enough */
+    current_header = current_header->next;
   }
 
   return NULL;
-  
+
 } /* first_fit() */
 
 /*
@@ -191,661 +231,2411 @@ static header *first_fit(size_t size_requested) {
  *  recently allocated)
  */
 
-static header *next_fit(size_t size) {
-  /* try to find the block. if found, 
+static header *next_fit(arena *a, size_t size) {
+  if (is_address_ordered(a)) {
+    /* next_allocate only marks an address here: search upwards from it, */
+    /* then wrap around to the blocks below it */
+    uintptr_t rover = (uintptr_t) a->next_allocate;
+    header *found = address_fit(a, rover, UINTPTR_MAX, size);
+    if (found == NULL) {
+      found = address_fit(a, 0, rover, size);
+    }
+    if (found != NULL) {
+      allocate_block(a, found, size);
+      a->next_allocate = found;
+    }
+    return found;
+  }
+
+  /* try to find the block. if found,
   return a pointer to the header of that block. if not found,
   return NULL */
-  if (g_freelist_head == NULL) {
+  if (a->freelist_head == NULL) {
     return NULL;
   }
-  
-  header *current_header = g_next_allocate;
-  if (g_next_allocate == NULL) {
-    current_header = g_freelist_head;
-  }
-  
-  /* keeps track of whether or not we've looped to the beginning of the */
-  /* list yet */
-  bool looped = false;
-
-  bool block_found = false;
-  while (!block_found) {
-    printf("current_block:\n");
-    print_object(current_header);
-
-    /* if the size is exactly correct, simply remove this block from the free list */
-    if (TRUE_SIZE(current_header) == size) {
-      if ((current_header->size & 0b111) == ((state) ALLOCATED)) {
-        if (current_header->next == NULL) {
-          return NULL;
-        }
-        else {
-          current_header = current_header->next;
-          continue;
-        }
-      }
 
-      /* set g_next_allocate to the next free block after this one */
-      g_next_allocate = current_header->next;
+  header *first_header = a->next_allocate;
+  if (a->next_allocate == NULL) {
+    first_header = a->freelist_head;
+  }
 
-      /* play with pointers to maintain the integrity of the list */
-      /* if this is the head, check if there is a next block */
-      if (current_header == g_freelist_head) {
-        if (current_header->next != NULL) {
-          g_freelist_head = current_header->next;
-          current_header->next = NULL;
-          current_header->next->prev = NULL;
-        }
+  header *current_header = first_header;
+  size_t steps = 0;
+  do {
+    steps++;
+    if (TRUE_SIZE(current_header) >= size) {
+      a->window_steps += steps;
+      header *next_header = current_header->next;
+      header *leftover = allocate_block(a, current_header, size);
+
+      /* continue the next search from the leftover piece of this block */
+      /* if it was split, otherwise from the block after it */
+      if (leftover != NULL) {
+        a->next_allocate = leftover;
       }
-      /* if this isn't the head block, we know the prev isn't null */
       else {
-        /* if the next block is NULL, this takes care of that case as well */
-        (current_header->prev)->next = current_header->next;
-        if (current_header->next != NULL) {
-          (current_header->next)->prev = current_header->prev;
-        }
+        a->next_allocate = next_header;
       }
-         
-      /* now that we've fixed the pointers, */
-      /* take the block out of the free list */
-      current_header->size |= (state) ALLOCATED;
-
       return current_header;
     }
-    else if (TRUE_SIZE(current_header) > size) {
-
-      /* determine what must be left over to split the block */
-      int size_leftover_to_split = 2 * ALLOC_HEADER_SIZE; 
-      if (MIN_ALLOCATION >= ALLOC_HEADER_SIZE) {
-        size_leftover_to_split += ALLOC_HEADER_SIZE;
-      }
-
-      /* if the leftover data is large enough for another block, */
-      /* split the block */
-      if ((TRUE_SIZE(current_header) - size - ALLOC_HEADER_SIZE) >=
-         size_leftover_to_split) {
-        
-        /* split off the leftover block from the newly allocated block */
-        header *new_block = ((header *)(((char *) current_header) + 
-                            size + ALLOC_HEADER_SIZE));
-        new_block->size = current_header->size - size - ALLOC_HEADER_SIZE;
-        new_block->size |= (state) UNALLOCATED;
-
-        current_header->size -= (TRUE_SIZE(new_block) + ALLOC_HEADER_SIZE); 
-        current_header->size |= (state) ALLOCATED;
-
-        new_block->left_size = TRUE_SIZE(current_header);
-
-        header *to_return = current_header;
-
-        /* set the left_size of the block after the new block correctly */
-        header *new_blocks_right_neighbor = (header *) (((char *) new_block) + ALLOC_HEADER_SIZE + TRUE_SIZE(new_block));
-        new_blocks_right_neighbor->left_size = TRUE_SIZE(new_block);
-
-        /* remove the current block from the freelist */
-        if (current_header == g_freelist_head) {
-          if (current_header->next == NULL) {
-            g_freelist_head = NULL;
-          }
-          else {
-            g_freelist_head = current_header->next;
-            g_freelist_head->prev = NULL;
-          }
-        }
-        else {
-          /* if the next pointer of the right block is NULL, then we */
-          /* simply have to set the next pointer of the prev block to NULL */
-          if (current_header->next == NULL) {
-            (current_header->prev)->next = NULL;
-            current_header->prev = NULL;
-          }
-          /* if the next pointer is not NULL, then we need to maintain */
-          /* the integrity of the list */
-          else {
-            current_header->prev->next = current_header->next;
-            current_header->next->prev = current_header->prev;
-            current_header->prev = NULL;
-            current_header->next = NULL;
-          }
-        }
-        
-        insert_free_block(new_block);
-
-        /* set g_next_allocate to the new block */
-        g_next_allocate = new_block;
-
-        /* return this newly allocated block */
-        return to_return;
-      }
-      /* if the leftover data is not large enough, just allocate this */
-      /* whole block */
-      else {
-        /* play with pointers to maintain the free list */
-
-        /* if this is the head, check if there is a next block */
-        if (current_header == g_freelist_head) {
-          if (current_header->next != NULL) {
-            g_freelist_head = current_header->next;
-          }
-        }
-        /* if this isn't the head block, we know the prev isn't null */
-        else {
-          /* if the next block is NULL, this takes care of that case as well */
-          (current_header->prev)->next = current_header->next;
-        }
-
-        /* allocate the whole block */
-        current_header->size |= (state) ALLOCATED;
-
-        /* set g_next_allocate appropriately */
-        g_next_allocate = current_header->next;
-
-        return current_header;
-      }
-    }
-    else if (TRUE_SIZE(current_header) < size) {
-      /* look for the next block since this isn't big enough */
 
-      /* if the next block is NULL, check if we've already looped */
-      if (current_header->next == NULL) {
-        /* if this is the last block and we've already looped, then there */
-        /* is not a big enough block in the list */
-        if (looped) {
-          return NULL;
-        }
-        /* if we haven't looped yet, then we should */
-        else {
-          current_header = g_freelist_head;
-          looped = true;
-        }
-      }
-      /* otherwise, increment to the next block and check that */
-      else {
-        current_header = current_header->next;
-      }
+    /* loop back around to the head once we hit the end of the list */
+    current_header = current_header->next;
+    if (current_header == NULL) {
+      current_header = a->freelist_head;
     }
+  } while (current_header != first_header);
 
-  }
-
+  a->window_steps += steps;
   return NULL;
- 
+
 } /* next_fit() */
 
 /*
- * best_fit
- * Allocate the FIRST instance of the smallest block able to satisfy the
- * request
+ * Ordering of free blocks in the best fit tree: by size, then by address.
  */
 
-static header *best_fit(size_t size) {
-  printf("size requested: %ld\n", (long int) size);
+static inline bool tree_less(header *a, header *b) {
+  return (TRUE_SIZE(a) < TRUE_SIZE(b)) ||
+         ((TRUE_SIZE(a) == TRUE_SIZE(b)) && (a < b));
+} /* tree_less() */
 
-  header *current_free_block = g_freelist_head;
-  header *to_return = NULL;
-  while (current_free_block != NULL) {
-    /* if the size of this block is exactly the size requested, */
-    /* remove it from the list and return it to the user */
-    if (TRUE_SIZE(current_free_block) == size) {
-      to_return = current_free_block;
-      break;
-    }
-    /* if the size is bigger than requested, keep traversing the list to */
-    /* see if there is a smaller block available that still meets the */
-    /* user's request */
-    else if (TRUE_SIZE(current_free_block) > size) {
-      /* if this is the first block we've found that is big enough, set */
-      /* to be to_return and check the rest of the list */
-      if (to_return == NULL) {
-        to_return = current_free_block;
-      }
-      /* if we already found a block that was big enough */
-      else {
-        /* if this block is smaller than that block is, then this is */
-        /* the block we want to return */
-        if (TRUE_SIZE(current_free_block) < TRUE_SIZE(to_return)) {
-          to_return = current_free_block;
-        }
-      }
-    }
+/*
+ * Heap priority of a block in the best fit tree. It is a hash of the
+ * block's address, so it doesn't need to be stored in the block and the
+ * tree stays balanced in expectation no matter what order blocks arrive in.
+ */
 
-    /* now check the next block */
-    current_free_block = current_free_block->next;
-  }
+static inline uintptr_t tree_priority(header *h) {
+  uint64_t x = (uint64_t) (uintptr_t) h;
+  x ^= x >> 33;
+  x *= 0xff51afd7ed558ccdULL;
+  x ^= x >> 33;
+  return (uintptr_t) x;
+} /* tree_priority() */
 
-  /* if we made it through the whole list and still didn't find anything to */
-  /* give to the user, then return NULL */
-  if (to_return == NULL) {
-    return NULL;
+/*
+ * Inserts a block into the best fit tree rooted at *root. The tree is a
+ * treap threaded through the free blocks themselves, prev holding the left
+ * child and next the right child, so it needs no memory of its own.
+ */
+
+static void tree_insert(header **root, header *h) {
+  header *node = *root;
+  if (node == NULL) {
+    h->prev = NULL;
+    h->next = NULL;
+    *root = h;
+    return;
   }
-  /* otherwise, allocate this block, remove from the list, and give to user */
-  else if (TRUE_SIZE(to_return) >= size) {
-    printf("the block we want to remove is:\n");
-    print_object(to_return);
-    /* determine what must be left over to split the block */
-    int size_leftover_to_split = 2 * ALLOC_HEADER_SIZE; 
-    if (MIN_ALLOCATION >= ALLOC_HEADER_SIZE) {
-      size_leftover_to_split += ALLOC_HEADER_SIZE;
-    }
-    printf("size leftover to split: %d\n", size_leftover_to_split);
-
-    /* if the leftover data is large enough for another block, */
-    /* split the block */
-    int leftover_space = (TRUE_SIZE(to_return) - size - ALLOC_HEADER_SIZE);
-    if (leftover_space >= size_leftover_to_split) {
-      printf("splitting the block\n");
-      
-      /* split off the leftover block from the newly allocated block */
-      header *new_block = ((header *)(((char *) to_return) + 
-                          size + ALLOC_HEADER_SIZE));
-      new_block->size = to_return->size - size - ALLOC_HEADER_SIZE;
-      new_block->size |= (state) UNALLOCATED;
-
-      to_return->size -= (TRUE_SIZE(new_block) + ALLOC_HEADER_SIZE); 
-      to_return->size |= (state) ALLOCATED;
-
-      new_block->left_size = TRUE_SIZE(to_return);
-
-      /* set the left_size of the block after the new block correctly */
-      header *new_blocks_right_neighbor = (header *) (((char *) new_block) + ALLOC_HEADER_SIZE + TRUE_SIZE(new_block));
-      new_blocks_right_neighbor->left_size = TRUE_SIZE(new_block);
-
-      /* remove the current block from the freelist */
-      if (to_return == g_freelist_head) {
-        if (to_return->next == NULL) {
-          g_freelist_head = NULL;
-        }
-        else {
-          g_freelist_head = to_return->next;
-          g_freelist_head->prev = NULL;
-        }
-      }
-      else {
-        /* if the next pointer of the right block is NULL, then we */
-        /* simply have to set the next pointer of the prev block to NULL */
-        if (to_return->next == NULL) {
-          (to_return->prev)->next = NULL;
-          to_return->prev = NULL;
-        }
-        /* if the next pointer is not NULL, then we need to maintain */
-        /* the integrity of the list */
-        else {
-          to_return->prev->next = to_return->next;
-          to_return->next->prev = to_return->prev;
-          to_return->prev = NULL;
-          to_return->next = NULL;
-        }
-      }
 
-      insert_free_block(new_block);
+  if (tree_less(h, node)) {
+    tree_insert(&node->prev, h);
 
-      /* return this newly allocated block */
-      return to_return;
+    /* rotate right if the new child outranks this node */
+    header *left = node->prev;
+    if (tree_priority(left) > tree_priority(node)) {
+      node->prev = left->next;
+      left->next = node;
+      *root = left;
     }
-    /* if the leftover data is not large enough to split, just allocate this */
-    /* whole block */
-    else {
-      printf("this block is not large enough to split, just going to allocate it\n");
-      /* play with pointers to maintain the free list */
-
-      /* if this is the head, check if there is a next block */
-      if (to_return == g_freelist_head) {
-        if (to_return->next != NULL) {
-          g_freelist_head = to_return->next;
-        }
-      }
-      /* if this isn't the head block, we know the prev isn't null */
-      else {
-        /* if the next block is NULL, this takes care of that case as well */
-        (to_return->prev)->next = to_return->next;
-        if (to_return->next != NULL) {
-          to_return->next->prev = to_return->prev;
-        }
-      }
-
-      /* allocate the whole block */
-      to_return->size |= (state) ALLOCATED;
-
-      return to_return;
-    } 
   }
-  /* the largest block was not large enough for the user, so return NULL */
   else {
-    printf("the block was not large enough to give to the user at all\n");
-    return NULL;
+    tree_insert(&node->next, h);
+
+    /* rotate left if the new child outranks this node */
+    header *right = node->next;
+    if (tree_priority(right) > tree_priority(node)) {
+      node->next = right->prev;
+      right->prev = node;
+      *root = right;
+    }
   }
- 
-} /* best_fit() */
+} /* tree_insert() */
 
 /*
- * worst_fit
+ * Joins two best fit trees where every block in left orders before every
+ * block in right.
  */
 
-static header *worst_fit(size_t size) {
-
-  header *biggest_block = NULL;
-  int biggest_block_size = 0;
-  header *current_free_block = g_freelist_head;
-
-  while (current_free_block != NULL) {
-    if (TRUE_SIZE(current_free_block) > biggest_block_size) {
-      biggest_block = current_free_block;
-      biggest_block_size = TRUE_SIZE(current_free_block);
-    }
-    current_free_block = current_free_block->next;
+static header *tree_merge(header *left, header *right) {
+  if (left == NULL) {
+    return right;
+  }
+  if (right == NULL) {
+    return left;
   }
 
-  /* if the biggest_block is NULL, then the list was empty */
-  if (biggest_block == NULL) {
-    return NULL;
+  if (tree_priority(left) > tree_priority(right)) {
+    left->next = tree_merge(left->next, right);
+    return left;
   }
-  /* if the biggest block is big enough to satisfy the request, return it */
-  else if (((size_t)biggest_block_size) >= size) {
-    /* determine what must be left over to split the block */
-    int size_leftover_to_split = 2 * ALLOC_HEADER_SIZE; 
-    if (MIN_ALLOCATION >= ALLOC_HEADER_SIZE) {
-      size_leftover_to_split += ALLOC_HEADER_SIZE;
-    }
-
-    /* if the leftover data is large enough for another block, */
-    /* split the block */
-    if ((TRUE_SIZE(biggest_block) - size - ALLOC_HEADER_SIZE) >=
-       size_leftover_to_split) {
-      
-      /* split off the leftover block from the newly allocated block */
-      header *new_block = ((header *)(((char *) biggest_block) + 
-                          size + ALLOC_HEADER_SIZE));
-      new_block->size = biggest_block->size - size - ALLOC_HEADER_SIZE;
-      new_block->size |= (state) UNALLOCATED;
-
-      biggest_block->size -= (TRUE_SIZE(new_block) + ALLOC_HEADER_SIZE); 
-      biggest_block->size |= (state) ALLOCATED;
-
-      new_block->left_size = TRUE_SIZE(biggest_block);
-
-      /* set the left_size of the block after the new block correctly */
-      header *new_blocks_right_neighbor = (header *) (((char *) new_block) + ALLOC_HEADER_SIZE + TRUE_SIZE(new_block));
-      new_blocks_right_neighbor->left_size = TRUE_SIZE(new_block);
-
-      /* remove the current block from the freelist */
-      if (biggest_block == g_freelist_head) {
-        if (biggest_block->next == NULL) {
-          g_freelist_head = NULL;
-        }
-        else {
-          g_freelist_head = biggest_block->next;
-          g_freelist_head->prev = NULL;
-        }
-      }
-      else {
-        /* if the next pointer of the right block is NULL, then we */
-        /* simply have to set the next pointer of the prev block to NULL */
-        if (biggest_block->next == NULL) {
-          (biggest_block->prev)->next = NULL;
-          biggest_block->prev = NULL;
-        }
-        /* if the next pointer is not NULL, then we need to maintain */
-        /* the integrity of the list */
-        else {
-          biggest_block->prev->next = biggest_block->next;
-          biggest_block->next->prev = biggest_block->prev;
-          biggest_block->prev = NULL;
-          biggest_block->next = NULL;
-        }
-      }
+  right->prev = tree_merge(left, right->prev);
+  return right;
+} /* tree_merge() */
 
-      insert_free_block(new_block);
+/*
+ * Removes a block from the best fit tree rooted at *root.
+ */
 
-      /* return this newly allocated block */
-      return biggest_block;
+static void tree_remove(header **root, header *h) {
+  /* the block's (size, address) key leads straight to it */
+  header **link = root;
+  while (*link != h) {
+    if (tree_less(h, *link)) {
+      link = &(*link)->prev;
     }
-    /* if the leftover data is not large enough to split, just allocate this */
-    /* whole block */
     else {
-      /* play with pointers to maintain the free list */
-
-      /* if this is the head, check if there is a next block */
-      if (biggest_block == g_freelist_head) {
-        if (biggest_block->next != NULL) {
-          g_freelist_head = biggest_block->next;
-        }
-      }
-      /* if this isn't the head block, we know the prev isn't null */
-      else {
-        /* if the next block is NULL, this takes care of that case as well */
-        (biggest_block->prev)->next = biggest_block->next;
-      }
-
-      /* allocate the whole block */
-      biggest_block->size |= (state) ALLOCATED;
-
-      return biggest_block;
-    } 
-  }
-  /* the largest block was not large enough for the user, so return NULL */
-  else {
-    return NULL;
+      link = &(*link)->next;
+    }
   }
 
-} /* worst_fit() */
+  *link = tree_merge(h->prev, h->next);
+} /* tree_remove() */
 
 /*
- * Returns the address of the block to allocate
- * based on the specified algorithm.
- *
- * If no block is available, returns NULL.
+ * Returns where the biggest block size in the address ordered subtree
+ * rooted at h is kept: the word after h's links, which every free block
+ * has room for.
  */
 
-static header *find_header(size_t size) {
-  if (g_freelist_head == NULL) {
-    return NULL;
-  }
-
-  switch (FIT_ALGORITHM) {
-    case 1:
-      return first_fit(size);
-    case 2:
-      return next_fit(size);
-    case 3:
-      return best_fit(size);
-    case 4:
-      return worst_fit(size);
-  }
-  assert(false);
-} /* find_header() */
+static inline size_t *subtree_max(header *h) {
+  return (size_t *) (h + 1);
+} /* subtree_max() */
 
 /*
- * Calculates the location of the left neighbor given a header.
+ * Recomputes the biggest block size in the address ordered subtree rooted
+ * at h from h and its children.
  */
 
-static inline header *left_neighbor(header *h) {
-  return (header *) (((char *) h) - h->left_size - ALLOC_HEADER_SIZE);
-} /* left_neighbor() */
+static inline void address_update(header *h) {
+  size_t biggest = TRUE_SIZE(h);
+  if ((h->prev != NULL) && (*subtree_max(h->prev) > biggest)) {
+    biggest = *subtree_max(h->prev);
+  }
+  if ((h->next != NULL) && (*subtree_max(h->next) > biggest)) {
+    biggest = *subtree_max(h->next);
+  }
+  *subtree_max(h) = biggest;
+} /* address_update() */
 
 /*
- * Calculates the location of the right neighbor given a header.
+ * Recomputes the biggest block sizes on the path from t down towards the
+ * address of h, after h was removed.
  */
 
-static inline header *right_neighbor(header *h) {
-  return (header *) (((char *) h) + ALLOC_HEADER_SIZE + TRUE_SIZE(h));
-} /* right_neighbor() */
+static void address_refresh(header *t, header *h) {
+  if (t == NULL) {
+    return;
+  }
+  if (t != h) {
+    address_refresh((h < t) ? t->prev : t->next, h);
+  }
+  address_update(t);
+} /* address_refresh() */
 
 /*
- * Insert a block at the beginning of the freelist.
- * The block is located after its left header, h.
+ * Splits the address ordered subtree t into the blocks below h, stored in
+ * *left, and the blocks above it, stored in *right.
  */
 
-static void insert_free_block(header *h) {
-
-  h->prev = NULL;
-
-  if (g_freelist_head != NULL) {
-    g_freelist_head->prev = h;
+static void address_split(header *t, header *h, header **left,
+                          header **right) {
+  if (t == NULL) {
+    *left = NULL;
+    *right = NULL;
+    return;
   }
 
-  h->next = g_freelist_head;
-  g_freelist_head = h;
-} /* insert_free_block() */
+  if (t < h) {
+    address_split(t->next, h, &t->next, right);
+    *left = t;
+  }
+  else {
+    address_split(t->prev, h, left, &t->prev);
+    *right = t;
+  }
+  address_update(t);
+} /* address_split() */
 
 /*
- * Instantiates fenceposts at the left and right side of a block.
+ * Inserts a block into the address ordered tree rooted at *root. Like the
+ * best fit tree, it is a treap threaded through the free blocks with the
+ * same address hash for priorities, but keyed by address alone. Each block
+ * also records the biggest block size in its subtree, which lets a search
+ * pass over subtrees with nothing big enough.
  */
 
-static void set_fenceposts(void *mem, size_t size) {
-  header *left_fence = (header *) mem;
-  header *right_fence = (header *) (((char *) mem) +
-                         (size - ALLOC_HEADER_SIZE));
-
-  left_fence->size = (state) FENCEPOST;
-  right_fence->size = (state) FENCEPOST;
-
-  right_fence->left_size = size - 3 * ALLOC_HEADER_SIZE;
+static void address_insert(header **root, header *h) {
+  /* h goes below every block that outranks it, so it counts towards */
+  /* their biggest sizes */
+  size_t size = TRUE_SIZE(h);
+  header **link = root;
+  while ((*link != NULL) && (tree_priority(*link) > tree_priority(h))) {
+    if (*subtree_max(*link) < size) {
+      *subtree_max(*link) = size;
+    }
+    link = (h < *link) ? &(*link)->prev : &(*link)->next;
+  }
 
-} /* set_fenceposts() */
+  /* what is there gets split by address into h's two subtrees */
+  if ((*link != NULL) && (*subtree_max(*link) > size)) {
+    size = *subtree_max(*link);
+  }
+  address_split(*link, h, &h->prev, &h->next);
+  *subtree_max(h) = size;
+  *link = h;
+} /* address_insert() */
 
 /*
- * Constructor that runs before main() to initialize the library.
+ * Joins two address ordered trees where every block in left lies below
+ * every block in right.
  */
 
-static void init() {
-  g_freelist_head = NULL;
-
-  /* Initialize mutex for thread safety */
-
-  pthread_mutex_init(&g_mutex, NULL);
+static header *address_merge(header *left, header *right) {
+  if (left == NULL) {
+    return right;
+  }
+  if (right == NULL) {
+    return left;
+  }
 
-  /* Manually set printf buffer so it won't call malloc */
+  if (tree_priority(left) > tree_priority(right)) {
+    left->next = address_merge(left->next, right);
+    address_update(left);
+    return left;
+  }
+  right->prev = address_merge(left, right->prev);
+  address_update(right);
+  return right;
+} /* address_merge() */
 
-  setvbuf(stdout, NULL, _IONBF, 0);
+/*
+ * Removes a block from the address ordered tree rooted at *root.
+ */
 
-  /* Record the starting address of the heap */
+static void address_remove(header **root, header *h) {
+  /* only the blocks above h whose biggest block was h's size can */
+  /* change, and they are the last ones on the way down */
+  header *stale = NULL;
+  header **link = root;
+  while (*link != h) {
+    if ((stale == NULL) && (*subtree_max(*link) == TRUE_SIZE(h))) {
+      stale = *link;
+    }
+    link = (h < *link) ? &(*link)->prev : &(*link)->next;
+  }
 
-  g_base = sbrk(0);
-} /* init() */
+  *link = address_merge(h->prev, h->next);
+  address_refresh(stale, h);
+} /* address_remove() */
 
 /*
- * malloc
+ * Puts the free block new_block in the place of h in the address ordered
+ * tree rooted at *root and takes h out, where new_block is the leftover of
+ * h after a split and h still has its old size. Nothing lies between the
+ * two in address order, so this takes one walk down the tree instead of a
+ * removal and an insertion.
  */
 
-void *my_malloc(size_t size) {
-  pthread_mutex_lock(&g_mutex);
-  
-  /* if requested size is 0, then return a null pointer */
-  if (size == 0) {
-    return NULL;
+static void address_replace(header **root, header *h, header *new_block) {
+  /* only the blocks above h whose biggest block was h's size can */
+  /* change, and they are the last ones on the way down */
+  header *stale = NULL;
+  header **link = root;
+  while ((*link != h) && (tree_priority(*link) > tree_priority(new_block))) {
+    if ((stale == NULL) && (*subtree_max(*link) == TRUE_SIZE(h))) {
+      stale = *link;
+    }
+    link = (h < *link) ? &(*link)->prev : &(*link)->next;
   }
 
-  /* round up the size to the nearest multiple of MIN_ALLOCATION */
-  int block_size_needed = ((size / MIN_ALLOCATION) * MIN_ALLOCATION);
-  if ((size % MIN_ALLOCATION) != 0) {
-    block_size_needed += MIN_ALLOCATION;
-  }
-  if (size < MIN_ALLOCATION) {
-    block_size_needed = MIN_ALLOCATION;
-  }
-  if (block_size_needed < (2 * sizeof(header *))) {
-    block_size_needed = 2 * sizeof(header *);
-  }
+  if (*link == h) {
+    /* new_block takes h's place and sinks below any children that */
+    /* outrank it */
+    new_block->prev = h->prev;
+    new_block->next = h->next;
+    *link = new_block;
+    if (stale == NULL) {
+      stale = new_block;
+    }
+    while (true) {
+      header *left = new_block->prev;
+      header *right = new_block->next;
+      header *top = new_block;
+      if ((left != NULL) && (tree_priority(left) > tree_priority(top))) {
+        top = left;
+      }
+      if ((right != NULL) && (tree_priority(right) > tree_priority(top))) {
+        top = right;
+      }
+      if (top == new_block) {
+        break;
+      }
+
+      /* rotate the child up over new_block */
+      if (stale == new_block) {
+        stale = top;
+      }
+      *link = top;
+      if (top == left) {
+        new_block->prev = left->next;
+        left->next = new_block;
+        link = &left->next;
+      }
+      else {
+        new_block->next = right->prev;
+        right->prev = new_block;
+        link = &right->prev;
+      }
+    }
+  }
+  else {
+    /* new_block outranks the block here, so it goes here: h comes out of */
+    /* the subtree, which is then split around new_block. The split walks */
+    /* the path h was on and fixes the biggest sizes along it. */
+    header **h_link = link;
+    while (*h_link != h) {
+      h_link = (h < *h_link) ? &(*h_link)->prev : &(*h_link)->next;
+    }
+    *h_link = address_merge(h->prev, h->next);
+    address_split(*link, new_block, &new_block->prev, &new_block->next);
+    *link = new_block;
+    if (stale == NULL) {
+      stale = new_block;
+    }
+  }
+
+  h->prev = NULL;
+  h->next = NULL;
+  address_refresh(stale, new_block);
+} /* address_replace() */
+
+/*
+ * Grows the biggest block sizes on the path from *root down to h, after h
+ * grew without moving.
+ */
+
+static void address_grow(header **root, header *h) {
+  header *t = *root;
+  while (true) {
+    if (*subtree_max(t) < TRUE_SIZE(h)) {
+      *subtree_max(t) = TRUE_SIZE(h);
+    }
+    if (t == h) {
+      break;
+    }
+    t = (h < t) ? t->prev : t->next;
+  }
+} /* address_grow() */
+
+/*
+ * Returns the lowest addressed block in the address ordered subtree rooted
+ * at t that lies in [start, end) and holds at least size bytes, or NULL if
+ * there is none.
+ */
+
+static header *address_search(arena *a, header *t, uintptr_t start,
+                              uintptr_t end, size_t size) {
+  while ((t != NULL) && (*subtree_max(t) >= size)) {
+    a->window_steps++;
+    if ((uintptr_t) t < start) {
+      t = t->next;
+    }
+    else if ((uintptr_t) t >= end) {
+      t = t->prev;
+    }
+    else {
+      /* t is in range, so a fit at a lower address would be to its left */
+      header *found = address_search(a, t->prev, start, end, size);
+      if (found != NULL) {
+        return found;
+      }
+      if (TRUE_SIZE(t) >= size) {
+        return t;
+      }
+      t = t->next;
+    }
+  }
+  return NULL;
+} /* address_search() */
+
+/*
+ * Returns the lowest addressed free block of arena a that lies in
+ * [start, end) and holds at least size bytes, or NULL if there is none.
+ * Subtrees with nothing big enough are passed over without being entered,
+ * so the search goes down the path to start or end, if it has one, and one
+ * more path to the block it finds: O(log n) blocks in expectation.
+ */
+
+static header *address_fit(arena *a, uintptr_t start, uintptr_t end,
+                           size_t size) {
+  return address_search(a, a->address_root, start, end, size);
+} /* address_fit() */
+
+/*
+ * Calls visit on every block in the address ordered tree rooted at t, in
+ * address order. This is a Morris traversal, which threads each subtree's
+ * last block to the block after it while walking it and unthreads it
+ * again, so it needs no stack however deep the tree is.
+ */
+
+static void visit_address_tree(header *t, void (*visit)(header *, void *),
+                               void *arg) {
+  while (t != NULL) {
+    if (t->prev == NULL) {
+      visit(t, arg);
+      t = t->next;
+      continue;
+    }
+
+    header *last = t->prev;
+    while ((last->next != NULL) && (last->next != t)) {
+      last = last->next;
+    }
+    if (last->next == NULL) {
+      last->next = t;
+      t = t->prev;
+    }
+    else {
+      last->next = NULL;
+      visit(t, arg);
+      t = t->next;
+    }
+  }
+} /* visit_address_tree() */
+
+/*
+ * best_fit
+ * Allocate the smallest block able to satisfy the request, taking the
+ * lowest addressed one if there are several of that size. Free blocks are
+ * kept in a tree ordered by (size, address), so this is the leftmost block
+ * in the tree that is big enough.
+ */
+
+static header *best_fit(arena *a, size_t size) {
+  header *to_return = NULL;
+  header *current_free_block = a->tree_root;
+  while (current_free_block != NULL) {
+    a->window_steps++;
+
+    /* anything big enough is a candidate, but a smaller one may still be */
+    /* further to the left */
+    if (TRUE_SIZE(current_free_block) >= size) {
+      to_return = current_free_block;
+      current_free_block = current_free_block->prev;
+    }
+    else {
+      current_free_block = current_free_block->next;
+    }
+  }
+
+  /* if nothing in the tree is big enough, then return NULL */
+  if (to_return == NULL) {
+    return NULL;
+  }
+
+  allocate_block(a, to_return, size);
+  return to_return;
+
+} /* best_fit() */
+
+/*
+ * worst_fit
+ */
+
+static header *worst_fit(arena *a, size_t size) {
+  /* the root of the address ordered tree knows the biggest block size, */
+  /* and a search for that size finds the lowest block of it */
+  if (is_address_ordered(a)) {
+    header *root = a->address_root;
+    if ((root == NULL) || (*subtree_max(root) < size)) {
+      return NULL;
+    }
+    header *biggest_block = address_fit(a, 0, UINTPTR_MAX,
+                                        *subtree_max(root));
+    allocate_block(a, biggest_block, size);
+    return biggest_block;
+  }
+
+  header *biggest_block = NULL;
+  size_t biggest_block_size = 0;
+  header *current_free_block = a->freelist_head;
+
+  while (current_free_block != NULL) {
+    if (TRUE_SIZE(current_free_block) > biggest_block_size) {
+      biggest_block = current_free_block;
+      biggest_block_size = TRUE_SIZE(current_free_block);
+    }
+    current_free_block = current_free_block->next;
+  }
+
+  /* if the biggest_block is NULL, then the list was empty, and if the */
+  /* biggest block is too small then nothing in the list can be used */
+  if ((biggest_block == NULL) || (biggest_block_size < size)) {
+    return NULL;
+  }
+
+  allocate_block(a, biggest_block, size);
+  return biggest_block;
+
+} /* worst_fit() */
+
+/*
+ * Computes the TLSF bucket a block of the given size belongs in.
+ */
+
+static inline void tlsf_mapping(size_t size, size_t *fl, size_t *sl) {
+  if (size < TLSF_SMALL_BLOCK_SIZE) {
+    /* small blocks are spread linearly across the first bucket row */
+    *fl = 0;
+    *sl = size / (TLSF_SMALL_BLOCK_SIZE / TLSF_SL_COUNT);
+  }
+  else {
+    size_t high_bit = (sizeof(size_t) * 8) - 1 - __builtin_clzl(size);
+    *sl = (size >> (high_bit - TLSF_SL_LOG2)) ^ TLSF_SL_COUNT;
+    *fl = high_bit - (TLSF_FL_SHIFT - 1);
+  }
+} /* tlsf_mapping() */
+
+/*
+ * Allocate a block from the first non-empty TLSF bucket whose smallest
+ * member is still large enough for the request (good fit). Both the search
+ * and the split run in constant time.
+ */
+
+static header *tlsf_fit(arena *a, size_t size) {
+  /* round the request up to the start of the next bucket so that any */
+  /* block in the bucket we land on is guaranteed to be big enough */
+  size_t search_size = size;
+  if (search_size >= TLSF_SMALL_BLOCK_SIZE) {
+    size_t high_bit = (sizeof(size_t) * 8) - 1 - __builtin_clzl(search_size);
+    search_size += ((size_t) 1 << (high_bit - TLSF_SL_LOG2)) - 1;
+  }
+
+  size_t fl = 0;
+  size_t sl = 0;
+  tlsf_mapping(search_size, &fl, &sl);
+  if (fl >= TLSF_FL_COUNT) {
+    return NULL;
+  }
+
+  /* look for a non-empty bucket in this row first, then in larger rows */
+  uint32_t sl_map = a->tlsf_sl_bitmap[fl] & (~((uint32_t) 0) << sl);
+  if (sl_map == 0) {
+    uint64_t fl_map = a->tlsf_fl_bitmap & (~((uint64_t) 0) << (fl + 1));
+    if (fl_map == 0) {
+      return NULL;
+    }
+    fl = __builtin_ctzll(fl_map);
+    sl_map = a->tlsf_sl_bitmap[fl];
+  }
+  sl = __builtin_ctz(sl_map);
+
+  header *block = a->tlsf_blocks[fl][sl];
+  allocate_block(a, block, size);
+  return block;
+} /* tlsf_fit() */
+
+/*
+ * Returns the address of the block to allocate
+ * based on the arena's fit policy.
+ *
+ * If no block is available, returns NULL.
+ */
+
+static header *find_header(arena *a, size_t size) {
+  header *found = NULL;
+  switch (a->fit) {
+    case 1:
+      found = first_fit(a, size);
+      break;
+    case 2:
+      found = next_fit(a, size);
+      break;
+    case 3:
+      found = best_fit(a, size);
+      break;
+    case 4:
+      found = worst_fit(a, size);
+      break;
+    case 5:
+      found = tlsf_fit(a, size);
+      break;
+    default:
+      assert(false);
+  }
+
+  if (a->adaptive && (++a->window_searches == ADAPT_WINDOW)) {
+    adapt_fit(a);
+  }
+  return found;
+} /* find_header() */
+
+/*
+ * Returns the calling thread's counters, linking them into g_stats_threads
+ * the first time.
+ */
+
+static inline thread_stats *local_stats(void) {
+  if (MALLOC_STATS && !g_thread_stats.registered) {
+    pthread_mutex_lock(&g_stats_mutex);
+    g_thread_stats.registered = true;
+    g_thread_stats.prev = NULL;
+    g_thread_stats.next = g_stats_threads;
+    if (g_stats_threads != NULL) {
+      g_stats_threads->prev = &g_thread_stats;
+    }
+    g_stats_threads = &g_thread_stats;
+    pthread_mutex_unlock(&g_stats_mutex);
+    pthread_setspecific(g_stats_key, &g_thread_stats);
+  }
+  return &g_thread_stats;
+} /* local_stats() */
+
+/*
+ * Adds n to one of the calling thread's counters.
+ */
+
+static inline void stats_add(uint64_t *counter, uint64_t n) {
+  if (MALLOC_STATS) {
+    __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n,
+                     __ATOMIC_RELAXED);
+  }
+} /* stats_add() */
+
+/*
+ * Returns the my_malloc_stats() size class of a request: class 0 holds
+ * requests of up to 8 bytes and each class after that doubles the limit.
+ */
+
+static inline size_t stats_class(size_t size) {
+  if (size <= 8) {
+    return 0;
+  }
+  size_t index = (64 - __builtin_clzll(size - 1)) - 3;
+  if (index >= MALLOC_STATS_CLASS_COUNT) {
+    index = MALLOC_STATS_CLASS_COUNT - 1;
+  }
+  return index;
+} /* stats_class() */
+
+/*
+ * pthread key destructor that folds an exiting thread's counters into
+ * g_stats_retired.
+ */
+
+static void stats_retire(void *stats) {
+  thread_stats *t = (thread_stats *) stats;
+  pthread_mutex_lock(&g_stats_mutex);
+  g_stats_retired.lock_wait_ns += t->lock_wait_ns;
+  for (size_t i = 0; i < MALLOC_STATS_CLASS_COUNT; i++) {
+    g_stats_retired.allocations[i] += t->allocations[i];
+  }
+
+  if (t->prev != NULL) {
+    t->prev->next = t->next;
+  }
+  else {
+    g_stats_threads = t->next;
+  }
+  if (t->next != NULL) {
+    t->next->prev = t->prev;
+  }
+  memset(t, 0, sizeof(*t));
+  pthread_mutex_unlock(&g_stats_mutex);
+} /* stats_retire() */
+
+/*
+ * Locks arena a. Only when the lock is contended is the time spent waiting
+ * for it measured, so the uncontended path costs a single trylock.
+ */
+
+static inline void lock_arena(arena *a) {
+  if (!MALLOC_STATS) {
+    pthread_mutex_lock(&a->mutex);
+    return;
+  }
+  if (pthread_mutex_trylock(&a->mutex) == 0) {
+    return;
+  }
+
+  struct timespec start;
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  pthread_mutex_lock(&a->mutex);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  stats_add(&local_stats()->lock_wait_ns,
+            ((end.tv_sec - start.tv_sec) * 1000000000LL) +
+            (end.tv_nsec - start.tv_nsec));
+} /* lock_arena() */
+
+/*
+ * Calculates the location of the right neighbor given a header.
+ */
+
+static inline header *right_neighbor(header *h) {
+  return (header *) (((char *) h) + BLOCK_HEADER_SIZE + TRUE_SIZE(h));
+} /* right_neighbor() */
+
+/*
+ * Returns the left neighbor of h if it is a free block, or NULL if it is
+ * allocated or a fencepost.
+ */
+
+static inline header *left_free_neighbor(header *h) {
+#ifdef COMPACT_HEADERS
+  if (!(h->size & LEFT_FREE)) {
+    return NULL;
+  }
+
+  /* the left neighbor's footer sits right before h */
+  size_t left_size = *(((size_t *) h) - 1);
+  return (header *) (((char *) h) - left_size - BLOCK_HEADER_SIZE);
+#else
+  header *left = (header *) (((char *) h) - h->left_size - BLOCK_HEADER_SIZE);
+  if (BLOCK_STATE(left) != ((state) UNALLOCATED)) {
+    return NULL;
+  }
+  return left;
+#endif
+} /* left_free_neighbor() */
+
+/*
+ * Records the size and state of h where its right neighbor looks for them.
+ * Must be called whenever a block changes size or is allocated or freed.
+ */
+
+static inline void update_boundary(header *h) {
+  header *right = right_neighbor(h);
+#ifdef COMPACT_HEADERS
+  if (BLOCK_STATE(h) == ((state) UNALLOCATED)) {
+    *(((size_t *) right) - 1) = TRUE_SIZE(h);
+    right->size |= LEFT_FREE;
+  }
+  else {
+    right->size &= ~((size_t) LEFT_FREE);
+  }
+#else
+  right->left_size = TRUE_SIZE(h);
+#endif
+} /* update_boundary() */
+
+/*
+ * Insert a block at the beginning of the freelist (or into its TLSF bucket,
+ * the best fit tree or the address ordered tree). The block is located
+ * after its left header, h.
+ */
+
+static void insert_free_block(arena *a, header *h) {
+  if (a->fit == 3) {
+    tree_insert(&a->tree_root, h);
+    return;
+  }
+
+  if (is_address_ordered(a)) {
+    address_insert(&a->address_root, h);
+    return;
+  }
+
+  if (a->fit == 5) {
+    /* push the block onto its TLSF bucket and mark the bucket non-empty */
+    size_t fl = 0;
+    size_t sl = 0;
+    tlsf_mapping(TRUE_SIZE(h), &fl, &sl);
+
+    h->prev = NULL;
+    h->next = a->tlsf_blocks[fl][sl];
+    if (h->next != NULL) {
+      h->next->prev = h;
+    }
+    a->tlsf_blocks[fl][sl] = h;
+    a->tlsf_fl_bitmap |= ((uint64_t) 1) << fl;
+    a->tlsf_sl_bitmap[fl] |= ((uint32_t) 1) << sl;
+    return;
+  }
+
+  h->prev = NULL;
+
+  if (a->freelist_head != NULL) {
+    a->freelist_head->prev = h;
+  }
+
+  h->next = a->freelist_head;
+  a->freelist_head = h;
+} /* insert_free_block() */
+
+/*
+ * Unlink a block from the freelist (or from its TLSF bucket, the best fit
+ * tree or the address ordered tree).
+ */
+
+static void remove_free_block(arena *a, header *h) {
+  if ((a->fit == 3) || is_address_ordered(a)) {
+    if (a->fit == 3) {
+      tree_remove(&a->tree_root, h);
+    }
+    else {
+      address_remove(&a->address_root, h);
+    }
+    h->next = NULL;
+    h->prev = NULL;
+    return;
+  }
+
+  /* keep next fit pointing at a block that is still in the list */
+  if (a->next_allocate == h) {
+    a->next_allocate = h->next;
+  }
+
+  if (h->next != NULL) {
+    h->next->prev = h->prev;
+  }
+
+  if (h->prev != NULL) {
+    h->prev->next = h->next;
+  }
+  else if (a->fit == 5) {
+    /* h was the first block in its bucket */
+    size_t fl = 0;
+    size_t sl = 0;
+    tlsf_mapping(TRUE_SIZE(h), &fl, &sl);
+
+    a->tlsf_blocks[fl][sl] = h->next;
+    if (h->next == NULL) {
+      a->tlsf_sl_bitmap[fl] &= ~(((uint32_t) 1) << sl);
+      if (a->tlsf_sl_bitmap[fl] == 0) {
+        a->tlsf_fl_bitmap &= ~(((uint64_t) 1) << fl);
+      }
+    }
+  }
+  else {
+    a->freelist_head = h->next;
+  }
+
+  h->next = NULL;
+  h->prev = NULL;
+} /* remove_free_block() */
+
+/*
+ * Changes the size of a block that is already in the freelist. The list
+ * based algorithms leave the block where it is, and so does the address
+ * ordered tree when the block grows, raising the biggest sizes above it.
+ * TLSF and the trees otherwise have to move it to the bucket or tree
+ * position for its new size.
+ */
+
+static void resize_free_block(arena *a, header *h, size_t size) {
+  if (is_address_ordered(a) && (size >= TRUE_SIZE(h))) {
+    h->size = size | (state) UNALLOCATED;
+    address_grow(&a->address_root, h);
+  }
+  else if ((a->fit == 3) || (a->fit == 5) || is_address_ordered(a)) {
+    remove_free_block(a, h);
+    h->size = size | (state) UNALLOCATED;
+    insert_free_block(a, h);
+  }
+  else {
+    h->size = size | (state) UNALLOCATED;
+  }
+  update_boundary(h);
+} /* resize_free_block() */
+
+/*
+ * Returns true if a block of block_size bytes has enough room left over
+ * after its first size bytes to split the rest off as a block of its own.
+ */
+
+static inline bool can_split(size_t block_size, size_t size) {
+  /* determine what must be left over to split the block */
+  size_t size_leftover_to_split = 2 * BLOCK_HEADER_SIZE;
+  if (MIN_ALLOCATION >= BLOCK_HEADER_SIZE) {
+    size_leftover_to_split += BLOCK_HEADER_SIZE;
+  }
+  if (size_leftover_to_split < MIN_BLOCK_SIZE) {
+    size_leftover_to_split = MIN_BLOCK_SIZE;
+  }
+
+  return block_size >= size + BLOCK_HEADER_SIZE + size_leftover_to_split;
+} /* can_split() */
+
+/*
+ * Takes the free block h out of the freelist and marks it allocated. If the
+ * leftover space is large enough to be a block of its own, it is split off
+ * and put back in the freelist. Returns the leftover block, or NULL if the
+ * whole block was handed out.
+ */
+
+static header *allocate_block(arena *a, header *h, size_t size) {
+  /* the leftover takes h's place in the address ordered tree */
+  bool split = can_split(TRUE_SIZE(h), size);
+  bool replace = split && is_address_ordered(a);
+  if (!replace) {
+    remove_free_block(a, h);
+  }
+
+  /* if the leftover data is not large enough for another block, just */
+  /* allocate this whole block */
+  if (!split) {
+    h->size |= (state) ALLOCATED;
+    update_boundary(h);
+    a->bytes_in_use += TRUE_SIZE(h) + BLOCK_HEADER_SIZE;
+    return NULL;
+  }
+
+  /* split off the leftover block from the newly allocated block */
+  header *new_block = (header *) (((char *) h) + BLOCK_HEADER_SIZE + size);
+  new_block->size = TRUE_SIZE(h) - size - BLOCK_HEADER_SIZE;
+  new_block->size |= (state) UNALLOCATED;
+  if (replace) {
+    address_replace(&a->address_root, h, new_block);
+  }
+
+  h->size = size | (state) ALLOCATED;
+
+  /* tell both the new block and the block after it about their new left */
+  /* neighbors */
+  update_boundary(h);
+  update_boundary(new_block);
+  a->bytes_in_use += size + BLOCK_HEADER_SIZE;
+
+  if (!replace) {
+    insert_free_block(a, new_block);
+  }
+  return new_block;
+} /* allocate_block() */
+
+/*
+ * Instantiates fenceposts at the left and right side of a block.
+ */
+
+static void set_fenceposts(void *mem, size_t size) {
+  header *left_fence = (header *) mem;
+  header *right_fence = (header *) (((char *) mem) +
+                         (size - BLOCK_HEADER_SIZE));
+
+  left_fence->size = (state) FENCEPOST;
+  right_fence->size = (state) FENCEPOST;
+
+#ifndef COMPACT_HEADERS
+  right_fence->left_size = size - 3 * BLOCK_HEADER_SIZE;
+#endif
+
+} /* set_fenceposts() */
+
+/*
+ * Records that the pages in [start, start + size) belong to arena a, or to
+ * no arena if a is NULL. The caller must hold g_heap_mutex.
+ */
+
+static bool chunk_map_set(void *start, size_t size, arena *a) {
+  uintptr_t first_page = ((uintptr_t) start) >> CHUNK_MAP_PAGE_SHIFT;
+  uintptr_t last_page = (((uintptr_t) start) + size - 1) >> CHUNK_MAP_PAGE_SHIFT;
+
+  for (uintptr_t page = first_page; page <= last_page; page++) {
+    size_t root = page >> CHUNK_MAP_LEAF_BITS;
+    uint8_t *leaf = g_chunk_map[root];
+    if ((leaf == NULL) && (a == NULL)) {
+      continue;
+    }
+    if (leaf == NULL) {
+      leaf = mmap(NULL, CHUNK_MAP_LEAF_SIZE, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+      if (leaf == MAP_FAILED) {
+        return false;
+      }
+      __atomic_store_n(&g_chunk_map[root], leaf, __ATOMIC_RELEASE);
+    }
+    leaf[page & (CHUNK_MAP_LEAF_SIZE - 1)] = (a == NULL) ? 0 :
+                                             (uint8_t) (a->index + 1);
+  }
+  return true;
+} /* chunk_map_set() */
+
+/*
+ * Returns the arena that owns the given block.
+ */
+
+static inline arena *arena_of(header *h) {
+  uintptr_t page = ((uintptr_t) h) >> CHUNK_MAP_PAGE_SHIFT;
+  uint8_t *leaf = __atomic_load_n(&g_chunk_map[page >> CHUNK_MAP_LEAF_BITS],
+                                  __ATOMIC_ACQUIRE);
+  assert(leaf != NULL);
+  uint8_t owner = leaf[page & (CHUNK_MAP_LEAF_SIZE - 1)];
+  assert(owner != 0);
+  return &g_arenas[owner - 1];
+} /* arena_of() */
+
+/*
+ * Returns the arena the calling thread allocates from, assigning arenas to
+ * threads round robin the first time each thread asks.
+ */
+
+static inline arena *thread_arena(void) {
+  if (g_thread_arena == NULL) {
+    unsigned int index = __atomic_fetch_add(&g_next_arena_index, 1,
+                                            __ATOMIC_RELAXED);
+    g_thread_arena = &g_arenas[index % g_arena_count];
+
+    /* register the cache so the thread's exit is noticed even if it */
+    /* never caches a block */
+    if (!g_tcache.registered) {
+      g_tcache.registered = true;
+      pthread_setspecific(g_tcache_key, &g_tcache);
+    }
+  }
+  return g_thread_arena;
+} /* thread_arena() */
+
+/*
+ * Returns the unit the arenas' memory is committed and released in: whole
+ * huge pages when they are on, so that none is split, and pages otherwise.
+ */
+
+static inline size_t commit_unit(void) {
+  return __atomic_load_n(&g_huge_pages, __ATOMIC_RELAXED) ? HUGE_PAGE_SIZE :
+                                                            g_page_size;
+} /* commit_unit() */
+
+#ifdef HEAP_SBRK
+/*
+ * Carves size bytes, a multiple of HUGE_PAGE_SIZE, out of the current huge
+ * page region, reserving a new region if it is used up. Regions are mapped
+ * with MAP_NORESERVE, so only the pages the arenas touch use memory. The
+ * caller must hold g_heap_mutex.
+ *
+ * Returns NULL if the region can't be mapped or the kernel won't back it
+ * with huge pages.
+ */
+
+static char *huge_region_grow(size_t size) {
+  if ((size_t) (g_huge_end - g_huge_next) < size) {
+    size_t region_size = HUGE_REGION_SIZE;
+    if (region_size < size) {
+      region_size = size;
+    }
+
+    /* map an extra huge page so the region can be aligned to one */
+    char *reserved = mmap(NULL, region_size + HUGE_PAGE_SIZE,
+                          PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (reserved == MAP_FAILED) {
+      return NULL;
+    }
+    char *aligned = (char *) ((((uintptr_t) reserved) + HUGE_PAGE_SIZE - 1) &
+                              ~(HUGE_PAGE_SIZE - 1));
+    if (aligned != reserved) {
+      munmap(reserved, aligned - reserved);
+    }
+    munmap(aligned + region_size, HUGE_PAGE_SIZE - (aligned - reserved));
+
+    if (madvise(aligned, region_size, MADV_HUGEPAGE) != 0) {
+      munmap(aligned, region_size);
+      return NULL;
+    }
+
+    /* what was left of the old region is never touched, so it costs */
+    /* nothing but address space */
+    g_huge_next = aligned;
+    g_huge_end = aligned + region_size;
+  }
+
+  char *chunk = g_huge_next;
+  g_huge_next += size;
+  return chunk;
+} /* huge_region_grow() */
+#else
+/*
+ * Commits the next size bytes, a multiple of commit_unit(), of arena a's
+ * reserved range, first reserving a new range if there isn't room left in
+ * the current one. Ranges are aligned to a huge page when huge pages are
+ * on, and marked for them. The caller must hold g_heap_mutex.
+ *
+ * Returns NULL if no range can be reserved or the OS won't commit more.
+ */
+
+static char *commit_chunk(arena *a, size_t size) {
+  if ((size_t) (a->heap_limit - a->heap_end) < size) {
+    size_t reserve_size = (g_heap_reserve < size) ? size : g_heap_reserve;
+    size_t alignment = g_huge_pages ? HUGE_PAGE_SIZE : g_page_size;
+    reserve_size = (reserve_size + alignment - 1) & ~(alignment - 1);
+
+    /* reserve an extra alignment unit so the range can be aligned */
+    char *reserved = mmap(NULL, reserve_size + alignment, PROT_NONE,
+                          MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (reserved == MAP_FAILED) {
+      return NULL;
+    }
+    char *start = (char *) ((((uintptr_t) reserved) + alignment - 1) &
+                            ~(alignment - 1));
+    if (start != reserved) {
+      munmap(reserved, start - reserved);
+    }
+    munmap(start + reserve_size, alignment - (start - reserved));
+
+    /* without huge pages, go on with normal ones for good */
+    if (g_huge_pages && (madvise(start, reserve_size, MADV_HUGEPAGE) != 0)) {
+      __atomic_store_n(&g_huge_pages, false, __ATOMIC_RELAXED);
+    }
+
+    /* whatever is left of the old range stays reserved, but is never */
+    /* committed */
+    a->heap_start = start;
+    a->heap_end = start;
+    a->heap_limit = start + reserve_size;
+    if (g_base == NULL) {
+      g_base = start;
+    }
+  }
+
+  if (mprotect(a->heap_end, size, PROT_READ | PROT_WRITE) != 0) {
+    return NULL;
+  }
+  char *chunk = a->heap_end;
+  a->heap_end += size;
+  return chunk;
+} /* commit_chunk() */
+#endif
+
+/*
+ * Asks the OS for a new chunk of at least chunk_size bytes for arena a and
+ * adds it to the arena's freelist. If the chunk is contiguous with the
+ * arena's previous one, the fenceposts between them are dropped and the
+ * chunks are coalesced. The caller must hold a's mutex.
+ *
+ * Returns the free block holding the new memory, or NULL if the OS has no
+ * more memory to give.
+ */
+
+static header *allocate_chunk(arena *a, size_t chunk_size) {
+  pthread_mutex_lock(&g_heap_mutex);
+
+  /* chunks are whole pages so that each page belongs to a single arena, */
+  /* and whole huge pages when huge pages are on */
+  size_t unit = commit_unit();
+  chunk_size = (chunk_size + unit - 1) & ~(unit - 1);
+
+  char *ptr_to_new_chunk = NULL;
+  size_t padding = 0;
+#ifdef HEAP_SBRK
+  bool from_region = false;
+  if (g_huge_pages) {
+    ptr_to_new_chunk = huge_region_grow(chunk_size);
+    from_region = (ptr_to_new_chunk != NULL);
+
+    /* without huge pages, fall back to sbrk for good */
+    if (ptr_to_new_chunk == NULL) {
+      __atomic_store_n(&g_huge_pages, false, __ATOMIC_RELAXED);
+    }
+  }
+  if (ptr_to_new_chunk == NULL) {
+    /* pad the request if something else left the break unaligned */
+    padding = (g_page_size - (((uintptr_t) sbrk(0)) & (g_page_size - 1))) &
+              (g_page_size - 1);
+    ptr_to_new_chunk = sbrk(padding + chunk_size);
+    if (((void *) ptr_to_new_chunk) == ((void *) -1)) {
+      pthread_mutex_unlock(&g_heap_mutex);
+      return NULL;
+    }
+  }
+#else
+  ptr_to_new_chunk = commit_chunk(a, chunk_size);
+  if (ptr_to_new_chunk == NULL) {
+    pthread_mutex_unlock(&g_heap_mutex);
+    return NULL;
+  }
+#endif
+
+  /* if the chunk map can't grow to cover the chunk, nothing may use it, */
+  /* so give it back and leave the heap as it was */
+  if (!chunk_map_set(ptr_to_new_chunk + padding, chunk_size, a)) {
+    chunk_map_set(ptr_to_new_chunk + padding, chunk_size, NULL);
+#ifdef HEAP_SBRK
+    if (from_region) {
+      g_huge_next -= chunk_size;
+    }
+    else if (sbrk(0) == ptr_to_new_chunk + padding + chunk_size) {
+      sbrk(-(intptr_t) (padding + chunk_size));
+    }
+#else
+    mmap(ptr_to_new_chunk, chunk_size, PROT_NONE,
+         MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1, 0);
+    a->heap_end = ptr_to_new_chunk;
+#endif
+    pthread_mutex_unlock(&g_heap_mutex);
+    return NULL;
+  }
+  g_sbrk_calls++;
+  g_sbrk_bytes += padding + chunk_size;
+  ptr_to_new_chunk += padding;
+
+  pthread_mutex_unlock(&g_heap_mutex);
+  a->heap_bytes += chunk_size;
+
+  /* set fenceposts on the new chunk of data */
+  set_fenceposts(ptr_to_new_chunk, chunk_size);
+  header *new_chunk_r_fencepost = (header *) (ptr_to_new_chunk + chunk_size -
+                                              BLOCK_HEADER_SIZE);
+  header *new_chunk_header = NULL;
+
+  /* if the new chunk starts right where this arena's last one ended, the */
+  /* last chunk's right fencepost becomes the header of the new space */
+  if ((a->last_fence_post != NULL) &&
+      ((((char *) a->last_fence_post) + BLOCK_HEADER_SIZE) == ptr_to_new_chunk)) {
+    header *previous_block = left_free_neighbor(a->last_fence_post);
+
+    /* if the block before the old fencepost is free, just grow it over */
+    /* the fenceposts and the whole new chunk */
+    if (previous_block != NULL) {
+      resize_free_block(a, previous_block, TRUE_SIZE(previous_block) + chunk_size);
+      new_chunk_header = previous_block;
+    }
+    /* otherwise, we need to create a new entry in the free list */
+    /* for our new block */
+    else {
+      new_chunk_header = a->last_fence_post;
+      new_chunk_header->size = chunk_size - BLOCK_HEADER_SIZE;
+      new_chunk_header->size |= (state) UNALLOCATED;
+
+      /* add this new chunk to the free list */
+      insert_free_block(a, new_chunk_header);
+    }
+  }
+  /* if this is the first chunk or it is not contiguous with the last */
+  /* one, it gets its own entry in the free list */
+  else {
+    /* the address of the header is the left fencepost + */
+    /* BLOCK_HEADER_SIZE */
+    new_chunk_header = (header *) (ptr_to_new_chunk + BLOCK_HEADER_SIZE);
+    new_chunk_header->size = chunk_size - (3 * BLOCK_HEADER_SIZE);
+    new_chunk_header->size |= (state) UNALLOCATED;
+#ifndef COMPACT_HEADERS
+    new_chunk_header->left_size = 0;
+#endif
+
+    /* add this new chunk to the free list */
+    insert_free_block(a, new_chunk_header);
+  }
+
+  update_boundary(new_chunk_header);
+  a->last_fence_post = new_chunk_r_fencepost;
+  return new_chunk_header;
+} /* allocate_chunk() */
+
+/*
+ * Mapped blocks are placed so that their payload is aligned like any other
+ * block's, which can leave a little room in front of the header. Their
+ * mapping starts at the page holding the header and ends with the block.
+ */
+
+static inline char *mapping_start(header *h) {
+  return (char *) (((uintptr_t) h) & ~(g_page_size - 1));
+} /* mapping_start() */
+
+static inline size_t mapping_size(header *h) {
+  return (((char *) h) + BLOCK_HEADER_SIZE + TRUE_SIZE(h)) - mapping_start(h);
+} /* mapping_size() */
+
+/*
+ * Maps a block of at least size bytes directly from the OS, with its
+ * payload aligned to alignment bytes, a power of two no smaller than
+ * BLOCK_ALIGNMENT. The block is marked MMAPPED and is not part of any arena.
+ *
+ * Returns NULL if the OS has no more memory to give.
+ */
+
+static header *allocate_mmapped_block(size_t size, size_t alignment) {
+  /* an aligned payload always starts within alignment bytes of the start */
+  /* of the mapping, since the mapping itself is page aligned */
+  size_t map_size = (size + alignment + g_page_size - 1) & ~(g_page_size - 1);
+  if (map_size < size) {
+    return NULL;
+  }
+  char *map = mmap(NULL, map_size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (map == MAP_FAILED) {
+    return NULL;
+  }
+
+  /* give back the pages in front of the header and after the block */
+  char *payload = (char *) ((((uintptr_t) map) + BLOCK_HEADER_SIZE +
+                             alignment - 1) & ~(alignment - 1));
+  header *h = (header *) (payload - BLOCK_HEADER_SIZE);
+  char *start = mapping_start(h);
+  char *end = (char *) ((((uintptr_t) payload) + size + g_page_size - 1) &
+                        ~(g_page_size - 1));
+  if (start != map) {
+    munmap(map, start - map);
+  }
+  if (end != map + map_size) {
+    munmap(end, (map + map_size) - end);
+  }
+  __atomic_fetch_add(&g_mmap_calls, 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&g_mmapped_bytes, end - start, __ATOMIC_RELAXED);
+
+  h->size = (end - payload) | (state) ALLOCATED | MMAPPED;
+  return h;
+} /* allocate_mmapped_block() */
+
+/*
+ * Rounds a requested size up to the size of the block that will hold it.
+ */
+
+static inline size_t block_size_for(size_t size) {
+  if (size < MIN_BLOCK_SIZE) {
+    size = MIN_BLOCK_SIZE;
+  }
+
+  /* round up so the block, header included, spans a whole number of */
+  /* BLOCK_ALIGNMENT units */
+  size_t extent = (size + BLOCK_HEADER_SIZE + BLOCK_ALIGNMENT - 1) &
+                  ~((size_t) BLOCK_ALIGNMENT - 1);
+  return extent - BLOCK_HEADER_SIZE;
+} /* block_size_for() */
+
+/*
+ * Finds a free block of at least size bytes in arena a, asking the OS for
+ * more memory if there is none. The caller must hold a's mutex.
+ *
+ * Returns NULL if the OS has no more memory to give.
+ */
+
+static header *get_block(arena *a, size_t size) {
+  /* blocks other threads freed back to this arena go first */
+  drain_remote_frees(a);
 
   /* try to find a block in the free list that's big enough */
+  header *found_block_header = find_header(a, size);
+  if (found_block_header != NULL) {
+    return found_block_header;
+  }
+
+  /* merge the fastbins into the freelist and look again */
+  if (consolidate_fastbins(a)) {
+    found_block_header = find_header(a, size);
+    if (found_block_header != NULL) {
+      return found_block_header;
+    }
+  }
+
+  /* otherwise grow the arena by as much as it already has, within the */
+  /* growth bounds, but always by enough for the request */
+  size_t chunk_size = a->heap_bytes;
+  if (chunk_size < g_grow_min) {
+    chunk_size = g_grow_min;
+  }
+  if (chunk_size > g_grow_max) {
+    chunk_size = g_grow_max;
+  }
+  if (size + (3 * BLOCK_HEADER_SIZE) > chunk_size) {
+    chunk_size = size + (3 * BLOCK_HEADER_SIZE);
+  }
+
+  found_block_header = allocate_chunk(a, chunk_size);
+  if (found_block_header == NULL) {
+    return NULL;
+  }
+  allocate_block(a, found_block_header, size);
+  return found_block_header;
+} /* get_block() */
+
+/*
+ * Calls visit on every block in the best fit tree rooted at t, smallest
+ * first.
+ */
+
+static void visit_tree(header *t, void (*visit)(header *, void *), void *arg) {
+  if (t == NULL) {
+    return;
+  }
+  visit_tree(t->prev, visit, arg);
+  visit(t, arg);
+  visit_tree(t->next, visit, arg);
+} /* visit_tree() */
+
+/*
+ * Calls visit on every free block indexed by arena a. visit must not add or
+ * remove free blocks. The caller must hold a's mutex.
+ */
+
+void visit_free_blocks(arena *a, void (*visit)(header *, void *),
+                       void *arg) {
+  if (a->fit == 3) {
+    visit_tree(a->tree_root, visit, arg);
+    return;
+  }
+
+  if (is_address_ordered(a)) {
+    visit_address_tree(a->address_root, visit, arg);
+    return;
+  }
+
+  if (a->fit == 5) {
+    for (size_t fl = 0; fl < TLSF_FL_COUNT; fl++) {
+      for (size_t sl = 0; sl < TLSF_SL_COUNT; sl++) {
+        for (header *h = a->tlsf_blocks[fl][sl]; h != NULL; h = h->next) {
+          visit(h, arg);
+        }
+      }
+    }
+    return;
+  }
+
+  for (header *h = a->freelist_head; h != NULL; h = h->next) {
+    visit(h, arg);
+  }
+} /* visit_free_blocks() */
+
+/*
+ * Moves every free block of arena a to the index used by the given fit
+ * policy. The caller must hold a's mutex.
+ */
+
+static void set_arena_fit(arena *a, int fit) {
+  /* take every block out of the old index, chaining them through next */
+  header *blocks = NULL;
+  while (true) {
+    header *h = NULL;
+    if (a->fit == 3) {
+      h = a->tree_root;
+    }
+    else if (is_address_ordered(a)) {
+      h = a->address_root;
+    }
+    else if (a->fit == 5) {
+      if (a->tlsf_fl_bitmap != 0) {
+        size_t fl = __builtin_ctzll(a->tlsf_fl_bitmap);
+        h = a->tlsf_blocks[fl][__builtin_ctz(a->tlsf_sl_bitmap[fl])];
+      }
+    }
+    else {
+      h = a->freelist_head;
+    }
+    if (h == NULL) {
+      break;
+    }
+    remove_free_block(a, h);
+    h->next = blocks;
+    blocks = h;
+  }
+
+  a->fit = fit;
+  a->next_allocate = NULL;
+  while (blocks != NULL) {
+    header *next = blocks->next;
+    insert_free_block(a, blocks);
+    blocks = next;
+  }
+} /* set_arena_fit() */
+
+/*
+ * visit_free_blocks() callback that counts free blocks and bytes and finds
+ * the largest block, for adapt_fit().
+ */
+
+static void measure_free_block(header *h, void *totals) {
+  size_t *t = (size_t *) totals;
+  t[0]++;
+  t[1] += TRUE_SIZE(h);
+  if (TRUE_SIZE(h) > t[2]) {
+    t[2] = TRUE_SIZE(h);
+  }
+} /* measure_free_block() */
+
+/*
+ * Closes the current window of an adaptive arena and switches between next
+ * fit and best fit if the window calls for it. The caller must hold a's
+ * mutex.
+ */
+
+static void adapt_fit(arena *a) {
+  /* free block count, free bytes and largest free block */
+  size_t totals[3] = { 0, 0, 0 };
+  visit_free_blocks(a, measure_free_block, totals);
+
+  a->search_length = ((double) a->window_steps) / a->window_searches;
+  a->fragmentation = 0.0;
+  if (totals[1] >= ADAPT_MIN_FREE) {
+    a->fragmentation = 1.0 - (((double) totals[2]) / ((double) totals[1]));
+  }
+  a->window_searches = 0;
+  a->window_steps = 0;
+
+  if (a->fit == 2) {
+    const char *reason = NULL;
+    if (a->fragmentation > ADAPT_FRAG_HIGH) {
+      reason = "fragmentation above ADAPT_FRAG_HIGH under next fit";
+    }
+    else if (a->search_length > ADAPT_SEARCH_HIGH) {
+      reason = "next fit searches longer than ADAPT_SEARCH_HIGH";
+    }
+    if (reason != NULL) {
+      set_arena_fit(a, 3);
+      a->switch_reason = reason;
+      a->fit_switches++;
+      a->calm_windows = 0;
+    }
+    return;
+  }
+
+  /* a short list keeps next fit searches short */
+  if ((a->fragmentation < ADAPT_FRAG_LOW) &&
+      (totals[0] <= (size_t) ADAPT_SEARCH_HIGH)) {
+    a->calm_windows++;
+  }
+  else {
+    a->calm_windows = 0;
+  }
+  if (a->calm_windows >= ADAPT_CALM_WINDOWS) {
+    set_arena_fit(a, 2);
+    a->switch_reason = "fragmentation stayed below ADAPT_FRAG_LOW under "
+                       "best fit";
+    a->fit_switches++;
+    a->calm_windows = 0;
+  }
+} /* adapt_fit() */
+
+/*
+ * Tells the OS it can take back the whole pages of the free block h that lie
+ * within [start, end). The header, links, the word after them and the
+ * footer of h are never touched, so the block stays in the freelist, and
+ * the pages read back as zeroes the next time they are used.
+ *
+ * Returns true if any page was released.
+ */
+
+static bool release_free_pages(header *h, char *start, char *end) {
+  char *first = ((char *) (h + 1)) + sizeof(size_t);
+  char *last = ((char *) right_neighbor(h)) - sizeof(size_t);
+  if (start < first) {
+    start = first;
+  }
+  if (end > last) {
+    end = last;
+  }
+
+  /* releasing part of a huge page would split it back into small ones */
+  size_t unit = commit_unit();
+  start = (char *) ((((uintptr_t) start) + unit - 1) & ~(unit - 1));
+  end = (char *) (((uintptr_t) end) & ~(unit - 1));
+  if (start >= end) {
+    return false;
+  }
+  return madvise(start, end - start, MADV_DONTNEED) == 0;
+} /* release_free_pages() */
+
+/*
+ * visit_free_blocks() callback that releases all whole pages of a free
+ * block, recording in *released whether there were any.
+ */
+
+static void release_block_pages(header *h, void *released) {
+  if (release_free_pages(h, (char *) h, (char *) right_neighbor(h))) {
+    *((bool *) released) = true;
+  }
+} /* release_block_pages() */
+
+/*
+ * Shrinks arena a's heap if the last block of its most recent chunk is
+ * free, by decommitting the end of its range, or in the HEAP_SBRK build by
+ * a negative sbrk if the chunk ends at the program break. At least pad
+ * bytes of the block are kept. The caller must hold a's mutex.
+ *
+ * Returns true if any memory was given back.
+ */
+
+static bool trim_top(arena *a, size_t pad) {
+  if (a->last_fence_post == NULL) {
+    return false;
+  }
+  header *top = left_free_neighbor(a->last_fence_post);
+  if (top == NULL) {
+    return false;
+  }
+
+  /* keep the smallest block that can hold pad bytes, followed by the */
+  /* fencepost, rounded up to the commit unit */
+  if (pad < MIN_BLOCK_SIZE) {
+    pad = MIN_BLOCK_SIZE;
+  }
+  char *old_end = ((char *) a->last_fence_post) + BLOCK_HEADER_SIZE;
+  if (pad >= TRUE_SIZE(top)) {
+    return false;
+  }
+  size_t unit = commit_unit();
+  uintptr_t keep = ((uintptr_t) top) + (2 * BLOCK_HEADER_SIZE) + pad;
+  char *new_end = (char *) ((keep + unit - 1) & ~(unit - 1));
+  if (new_end >= old_end) {
+    return false;
+  }
+
+  pthread_mutex_lock(&g_heap_mutex);
+#ifdef HEAP_SBRK
+  /* other arenas may have grown the heap past this chunk since */
+  if ((sbrk(0) != old_end) || (sbrk(new_end - old_end) == (void *) -1)) {
+    pthread_mutex_unlock(&g_heap_mutex);
+    return false;
+  }
+#else
+  /* mapping fresh reserved pages over the end drops its memory and its */
+  /* commit charge at once */
+  if ((old_end != a->heap_end) ||
+      (mmap(new_end, old_end - new_end, PROT_NONE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | MAP_FIXED, -1,
+            0) == MAP_FAILED)) {
+    pthread_mutex_unlock(&g_heap_mutex);
+    return false;
+  }
+  a->heap_end = new_end;
+#endif
+  g_sbrk_calls++;
+  g_sbrk_bytes -= old_end - new_end;
+  chunk_map_set(new_end, old_end - new_end, NULL);
+  pthread_mutex_unlock(&g_heap_mutex);
+  a->heap_bytes -= old_end - new_end;
+
+  header *fence = (header *) (new_end - BLOCK_HEADER_SIZE);
+  fence->size = (state) FENCEPOST;
+  resize_free_block(a, top, ((char *) fence) - ((char *) top) -
+                            BLOCK_HEADER_SIZE);
+  a->last_fence_post = fence;
+  return true;
+} /* trim_top() */
+
+/*
+ * Returns an allocated block to the freelist, coalescing it with any free
+ * neighbors in its arena a. The caller must hold a's mutex.
+ */
+
+static void free_block(arena *a, header *block_to_free) {
+  /* get the right and left neighbors of this block */
+  header *right_block = right_neighbor(block_to_free);
+  header *left_block = left_free_neighbor(block_to_free);
+
+  /* remember the memory that was in use so its pages can be released */
+  char *freed_start = (char *) block_to_free;
+  char *freed_end = (char *) right_block;
+  a->bytes_in_use -= freed_end - freed_start;
+
+  /* set this newly freed block to UNALLOCATED */
+  block_to_free->size = TRUE_SIZE(block_to_free);
+
+  /* remember whether next fit was about to look at one of the blocks */
+  /* that is being merged away */
+  bool next_allocate_merged = ((a->next_allocate == right_block) ||
+                               ((left_block != NULL) &&
+                                (a->next_allocate == left_block)));
+
+  /* if the right neighbor is also an unallocated block, */
+  /* coalesce the blocks */
+  if (BLOCK_STATE(right_block) == ((state) UNALLOCATED)) {
+    remove_free_block(a, right_block);
+    block_to_free->size += TRUE_SIZE(right_block) + BLOCK_HEADER_SIZE;
+  }
+
+  /* if the left neighbor is also an unallocated block, grow it over this */
+  /* block, otherwise this block goes into the free list on its own */
+  if (left_block != NULL) {
+    resize_free_block(a, left_block, TRUE_SIZE(left_block) +
+                                  TRUE_SIZE(block_to_free) + BLOCK_HEADER_SIZE);
+    block_to_free = left_block;
+  }
+  else {
+    insert_free_block(a, block_to_free);
+    update_boundary(block_to_free);
+  }
+
+  /* set a->next_allocate appropriately */
+  if (next_allocate_merged) {
+    a->next_allocate = block_to_free;
+  }
+
+  /* give memory back to the OS once enough of it is free: the top of the */
+  /* heap is cut off, and large blocks further down lose their pages */
+  if ((g_trim_threshold != 0) &&
+      (TRUE_SIZE(block_to_free) >= g_trim_threshold)) {
+    if (right_neighbor(block_to_free) == a->last_fence_post) {
+      trim_top(a, g_trim_threshold / 2);
+    }
+    if ((size_t) (freed_end - freed_start) >= g_trim_threshold) {
+      release_free_pages(block_to_free, freed_start, freed_end);
+    }
+  }
+} /* free_block() */
+
+/*
+ * Frees every block waiting in a's fastbins into the freelist, coalescing
+ * them with their neighbors. The caller must hold a's mutex.
+ *
+ * Returns true if there was anything to free.
+ */
+
+static bool consolidate_fastbins(arena *a) {
+  if (a->fastbin_bytes == 0) {
+    return false;
+  }
+
+  for (size_t bin = 0; bin < FASTBIN_COUNT; bin++) {
+    header *h = a->fastbins[bin];
+    a->fastbins[bin] = NULL;
+    while (h != NULL) {
+      header *next = h->next;
+      free_block(a, h);
+      h = next;
+    }
+  }
+  a->fastbin_bytes = 0;
+  return true;
+} /* consolidate_fastbins() */
+
+/*
+ * Frees the allocated block h of arena a, parking it in a fastbin if it is
+ * small enough. The caller must hold a's mutex.
+ */
+
+static void fastbin_free(arena *a, header *h) {
+  if (TRUE_SIZE(h) > FASTBIN_MAX_SIZE) {
+    /* freeing a large block may let memory go back to the OS, which */
+    /* small blocks parked around it would otherwise prevent */
+    size_t size = TRUE_SIZE(h);
+    free_block(a, h);
+    if (size >= FASTBIN_MAX_BYTES) {
+      consolidate_fastbins(a);
+    }
+    return;
+  }
+
+  size_t bin = TRUE_SIZE(h) / BLOCK_ALIGNMENT;
+  h->next = a->fastbins[bin];
+  h->prev = NULL;
+  a->fastbins[bin] = h;
+  a->fastbin_bytes += TRUE_SIZE(h);
+
+  if (a->fastbin_bytes > FASTBIN_MAX_BYTES) {
+    consolidate_fastbins(a);
+  }
+} /* fastbin_free() */
+
+/*
+ * Takes a block of exactly size bytes out of a's fastbins, or returns NULL
+ * if there is none. The caller must hold a's mutex.
+ */
+
+static inline header *fastbin_pop(arena *a, size_t size) {
+  if (size > FASTBIN_MAX_SIZE) {
+    return NULL;
+  }
+
+  size_t bin = size / BLOCK_ALIGNMENT;
+  header *h = a->fastbins[bin];
+  if (h != NULL) {
+    a->fastbins[bin] = h->next;
+    a->fastbin_bytes -= TRUE_SIZE(h);
+  }
+  return h;
+} /* fastbin_pop() */
+
+/*
+ * Frees every block waiting in a's remote free queue. The caller must hold
+ * a's mutex.
+ */
+
+static void drain_remote_frees(arena *a) {
+  if (__atomic_load_n(&a->remote_frees, __ATOMIC_RELAXED) == NULL) {
+    return;
+  }
+
+  header *h = __atomic_exchange_n(&a->remote_frees, NULL, __ATOMIC_ACQUIRE);
+  size_t drained = 0;
+  while (h != NULL) {
+    header *next = h->next;
+    fastbin_free(a, h);
+    h = next;
+    drained++;
+  }
+  __atomic_sub_fetch(&a->remote_count, drained, __ATOMIC_RELAXED);
+} /* drain_remote_frees() */
+
+/*
+ * Queues the allocated block h to be freed by arena a, which the calling
+ * thread does not allocate from, without taking a's mutex.
+ */
+
+static void remote_free(arena *a, header *h) {
+  h->prev = NULL;
+  header *head = __atomic_load_n(&a->remote_frees, __ATOMIC_RELAXED);
   do {
-    header *found_block_header = find_header(block_size_needed);
+    h->next = head;
+  } while (!__atomic_compare_exchange_n(&a->remote_frees, &head, h, true,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+
+  /* don't let the queue grow without bound if a's threads are idle. */
+  /* The caller may hold its own arena's mutex, so waiting for a's could */
+  /* deadlock against a thread of a doing the same. */
+  if ((__atomic_add_fetch(&a->remote_count, 1, __ATOMIC_RELAXED) >=
+       REMOTE_FREE_MAX) && (pthread_mutex_trylock(&a->mutex) == 0)) {
+    drain_remote_frees(a);
+    pthread_mutex_unlock(&a->mutex);
+  }
+} /* remote_free() */
 
-    /* if we found a block */
-    if (found_block_header != NULL) {
-      return ((void *)(((char *) found_block_header) + ALLOC_HEADER_SIZE));
+/*
+ * Shrinks the allocated block h to size bytes, giving the tail back to the
+ * freelist if it is large enough to be a block of its own. The caller must
+ * hold a's mutex.
+ */
+
+static void shrink_block(arena *a, header *h, size_t size) {
+  if (!can_split(TRUE_SIZE(h), size)) {
+    return;
+  }
+
+  /* split the tail off as an allocated block and free it, so it is */
+  /* coalesced with the right neighbor like any other freed block */
+  header *tail = (header *) (((char *) h) + BLOCK_HEADER_SIZE + size);
+  tail->size = (TRUE_SIZE(h) - size - BLOCK_HEADER_SIZE) | (state) ALLOCATED;
+  update_boundary(tail);
+
+  /* keep the state bits, which in the compact layout include LEFT_FREE */
+  h->size = size | (h->size & 0b111);
+  update_boundary(h);
+
+  free_block(a, tail);
+} /* shrink_block() */
+
+/*
+ * Resizes the allocated block h to size bytes without moving it, either by
+ * splitting off its tail or by absorbing a free right neighbor. The caller
+ * must hold a's mutex.
+ *
+ * Returns false if the block cannot be grown in place.
+ */
+
+static bool resize_block_in_place(arena *a, header *h, size_t size) {
+  if (size > TRUE_SIZE(h)) {
+    header *right_block = right_neighbor(h);
+    if ((BLOCK_STATE(right_block) != ((state) UNALLOCATED)) ||
+        (TRUE_SIZE(h) + BLOCK_HEADER_SIZE + TRUE_SIZE(right_block) < size)) {
+      return false;
+    }
+
+    /* absorb the whole right neighbor, then give back what isn't needed */
+    remove_free_block(a, right_block);
+    a->bytes_in_use += TRUE_SIZE(right_block) + BLOCK_HEADER_SIZE;
+    h->size = (TRUE_SIZE(h) + BLOCK_HEADER_SIZE + TRUE_SIZE(right_block)) |
+              (h->size & 0b111);
+    update_boundary(h);
+  }
+
+  shrink_block(a, h, size);
+  return true;
+} /* resize_block_in_place() */
+
+/*
+ * Returns an allocated block of at least size bytes from arena a whose
+ * payload is a multiple of alignment bytes, a power of two larger than
+ * BLOCK_ALIGNMENT. A block with room for the worst case slack is taken from
+ * the freelist; the slack in front of the aligned payload is split off and
+ * freed as a block of its own, and the unused tail is given back the same
+ * way. The caller must hold a's mutex.
+ *
+ * Returns NULL if the OS has no more memory to give.
+ */
+
+static header *get_aligned_block(arena *a, size_t size, size_t alignment) {
+  /* slack in front of the payload must be able to hold a free block */
+  size_t min_slack = block_size_for(MIN_BLOCK_SIZE) + BLOCK_HEADER_SIZE;
+
+  header *h = get_block(a, size + min_slack + alignment);
+  if (h == NULL) {
+    return NULL;
+  }
+
+  uintptr_t payload = ((uintptr_t) h) + BLOCK_HEADER_SIZE;
+  if ((payload & (alignment - 1)) != 0) {
+    uintptr_t aligned = (payload + min_slack + alignment - 1) &
+                        ~(alignment - 1);
+    size_t slack = aligned - payload;
+
+    /* the aligned block takes over everything after the slack, and the */
+    /* slack keeps h's header and state bits until it is freed */
+    header *aligned_block = (header *) (aligned - BLOCK_HEADER_SIZE);
+    aligned_block->size = (TRUE_SIZE(h) - slack) | (state) ALLOCATED;
+    h->size = (slack - BLOCK_HEADER_SIZE) | (h->size & 0b111);
+    update_boundary(h);
+    update_boundary(aligned_block);
+
+    free_block(a, h);
+    h = aligned_block;
+  }
+
+  shrink_block(a, h, size);
+  return h;
+} /* get_aligned_block() */
+
+/*
+ * Carves count allocated blocks of size bytes each out of one free block of
+ * arena a, lined up one after the other, and stores their payloads in out.
+ * The caller must hold a's mutex.
+ *
+ * Returns false if the OS has no more memory to give.
+ */
+
+static bool get_block_run(arena *a, size_t size, size_t count, void **out) {
+  size_t extent = size + BLOCK_HEADER_SIZE;
+  header *h = get_block(a, (count * extent) - BLOCK_HEADER_SIZE);
+  if (h == NULL) {
+    return false;
+  }
+
+  /* the first block keeps h's state bits, and the last one gets whatever */
+  /* is left so it can give back the tail like a shrinking block */
+  size_t run_size = TRUE_SIZE(h);
+  h->size = size | (h->size & 0b111);
+  for (size_t i = 0; i < count; i++) {
+    header *block = (header *) (((char *) h) + (i * extent));
+    if (i != 0) {
+      block->size = size | (state) ALLOCATED;
+    }
+    if (i == count - 1) {
+      block->size = (run_size - (i * extent)) | (block->size & 0b111);
     }
+    update_boundary(block);
+    out[i] = ((char *) block) + BLOCK_HEADER_SIZE;
+  }
+
+  shrink_block(a, (header *) (((char *) out[count - 1]) - BLOCK_HEADER_SIZE),
+               size);
+  return true;
+} /* get_block_run() */
+
+/*
+ * Returns the thread cache bin for blocks of the given size.
+ */
+
+static inline size_t tcache_bin(size_t size) {
+  return size / MIN_ALLOCATION;
+} /* tcache_bin() */
+
+/*
+ * Pushes an allocated block onto this thread's cache. The block stays marked
+ * ALLOCATED so that neighbors being freed never coalesce with it.
+ */
+
+static inline void tcache_push(header *h) {
+  /* register the cache so it is drained when the thread exits */
+  if (!g_tcache.registered) {
+    g_tcache.registered = true;
+    pthread_setspecific(g_tcache_key, &g_tcache);
+  }
+
+  size_t bin = tcache_bin(TRUE_SIZE(h));
+  h->next = g_tcache.bins[bin];
+  h->prev = (header *) &g_tcache;
+  g_tcache.bins[bin] = h;
+  g_tcache.counts[bin]++;
+  g_tcache.bytes += TRUE_SIZE(h);
+} /* tcache_push() */
+
+/*
+ * Pops a cached block of exactly the given size, or returns NULL if this
+ * thread has none.
+ */
+
+static inline header *tcache_pop(size_t size) {
+  size_t bin = tcache_bin(size);
+  header *h = g_tcache.bins[bin];
+  if (h != NULL) {
+    g_tcache.bins[bin] = h->next;
+    g_tcache.counts[bin]--;
+    g_tcache.bytes -= TRUE_SIZE(h);
+    h->prev = NULL;
+  }
+  return h;
+} /* tcache_pop() */
+
+/*
+ * Moves cached blocks from the given bin back to their arenas until at
+ * most keep blocks are left. The calling thread's arena is locked once for
+ * the whole bin, and blocks of other arenas go onto their remote free
+ * queues. Partial flushes park the blocks in the fastbins for the next
+ * refill; emptying the bin frees them for good.
+ */
 
-    /* if we didn't find a block, need to request more memory */
+static void tcache_flush_bin(tcache *cache, size_t bin, unsigned int keep) {
+  arena *locked = NULL;
+  while (cache->counts[bin] > keep) {
+    header *h = cache->bins[bin];
+    cache->bins[bin] = h->next;
+    cache->counts[bin]--;
+    cache->bytes -= TRUE_SIZE(h);
+
+    arena *a = arena_of(h);
+    if (a != thread_arena()) {
+      remote_free(a, h);
+      continue;
+    }
+    if (a != locked) {
+      lock_arena(a);
+      locked = a;
+    }
+    if (keep != 0) {
+      fastbin_free(a, h);
+    }
     else {
+      free_block(a, h);
+    }
+  }
+  if (locked != NULL) {
+    pthread_mutex_unlock(&locked->mutex);
+  }
+} /* tcache_flush_bin() */
 
-      /* ask for a new chunk from sbrk() */
-      char *ptr_to_new_chunk = sbrk(ARENA_SIZE);
-      if (((void *) ptr_to_new_chunk) == ((void *) -1)) {
-        errno = ENOMEM;
-        return NULL;
-      }
+/*
+ * pthread key destructor that hands every block cached by an exiting thread
+ * back to the shared freelist.
+ */
 
-      /* set fenceposts on the new chunk of data */
-      set_fenceposts(ptr_to_new_chunk, ARENA_SIZE);
-      g_last_fence_post = (header *) (ptr_to_new_chunk + ARENA_SIZE - ALLOC_HEADER_SIZE);
-
-      /* check to see if the new chunk is contiguous with the one next to it */
-      /* if it is, coalesce the two chunks of data */
-      
-      header *new_chunk_l_fencepost = (header *) ptr_to_new_chunk;
-
-      /* only need to check for fencepost to the left if */
-      /* we've sbrk'd more than one chunk */
-      if (new_chunk_l_fencepost != g_base) {
-
-        /* if the left neighbor of this chunk is a fencepost, then we should */
-        /* coalesce the fenceposts */
-        if ((left_neighbor(new_chunk_l_fencepost)->size & 0b111) == ((state) FENCEPOST)) {
-
-          header * previous_block = left_neighbor(left_neighbor(new_chunk_l_fencepost));
-          previous_block->size += (2 * ALLOC_HEADER_SIZE);
-
-          /* if the previous block that we just added the fenceposts to is */
-          /* in the free list, then we can just merge that block with the */
-          /* block that we just added */
-          if ((previous_block->size & 0b111) == ((state) UNALLOCATED)) {
-            previous_block->size += (ARENA_SIZE - (2 * ALLOC_HEADER_SIZE));
-            right_neighbor((header *)ptr_to_new_chunk)->left_size = TRUE_SIZE(previous_block);
-          }
-          /* otherwise, we need to create a new entry in the free list */
-          /* for our new block */
-          else {
-            /* add the header to the chunk */
-            
-            /* the address of the header is the left fencepost + */
-            /* ALLOC_HEADER_SIZE */
-            header *new_chunk_header = (header *) (ptr_to_new_chunk + ALLOC_HEADER_SIZE);   
-            new_chunk_header->size = ARENA_SIZE - (3 * ALLOC_HEADER_SIZE); 
-            new_chunk_header->size |= (state) UNALLOCATED;
-            new_chunk_header->left_size = previous_block->size;
-            new_chunk_header->next = NULL;
-            new_chunk_header->prev = NULL;
-            
-            /* add this new chunk to the free list */
-            insert_free_block(new_chunk_header);
-          }
-        }
-        /* if the left neighbor isn't a fencepost, then we need to make */
-        /* a new entry in the free list */
-        else {
-            /* the address of the header is the left fencepost + */
-            /* ALLOC_HEADER_SIZE */
-            header *new_chunk_header = (header *) (ptr_to_new_chunk + ALLOC_HEADER_SIZE);   
-            new_chunk_header->size = ARENA_SIZE - (3 * ALLOC_HEADER_SIZE); 
-            new_chunk_header->size |= (state) UNALLOCATED;
-            new_chunk_header->left_size = 0;
-            new_chunk_header->next = NULL;
-            new_chunk_header->prev = NULL;
-        
-            /* add this new chunk to the free list */
-            insert_free_block(new_chunk_header);
+static void tcache_destroy(void *cache) {
+  for (size_t bin = 0; bin < TCACHE_BIN_COUNT; bin++) {
+    tcache_flush_bin((tcache *) cache, bin, 0);
+  }
+} /* tcache_destroy() */
 
-        }
-      }
-      /* if this is the first chunk we've asked for, add to free list */
-      else {
-        /* add the header to the chunk */
-        header *new_chunk_header = (header *) (ptr_to_new_chunk + ALLOC_HEADER_SIZE);   
-        new_chunk_header->size = ARENA_SIZE - (3 * ALLOC_HEADER_SIZE); 
-        new_chunk_header->size |= (state) UNALLOCATED;
-        new_chunk_header->next = NULL;
-        new_chunk_header->prev = NULL;
-        
-        /* add this new chunk to the free list */
-        insert_free_block(new_chunk_header);
+/*
+ * pthread key destructor for an exiting thread: its cache is drained and
+ * its arena's remote frees and fastbins are freed, so blocks parked by a
+ * thread that is gone don't keep the heap from shrinking. The cache is
+ * marked unregistered again, so a block freed by a destructor that runs
+ * after this one registers it anew and the key's destructor runs again.
+ */
+
+static void tcache_thread_exit(void *cache) {
+  tcache_destroy(cache);
+  g_tcache.registered = false;
+
+  arena *a = g_thread_arena;
+  if (a != NULL) {
+    lock_arena(a);
+    drain_remote_frees(a);
+    consolidate_fastbins(a);
+    pthread_mutex_unlock(&a->mutex);
+  }
+} /* tcache_thread_exit() */
+
+/*
+ * Pulls a batch of blocks of the given size out of the thread's arena with
+ * a single acquisition of its mutex. One block is returned to the caller
+ * and the rest are stored in this thread's cache.
+ *
+ * Returns NULL if the OS has no more memory to give.
+ */
+
+static header *tcache_refill(size_t size) {
+  arena *a = thread_arena();
+
+  lock_arena(a);
+  header *to_return = fastbin_pop(a, size);
+  if (to_return == NULL) {
+    to_return = get_block(a, size);
+  }
+  for (int i = 1; (to_return != NULL) && (i < TCACHE_BATCH); i++) {
+    /* stop early rather than grow the heap just to fill the cache */
+    header *h = fastbin_pop(a, size);
+    if (h == NULL) {
+      h = find_header(a, size);
+    }
+    if (h == NULL) {
+      break;
+    }
+    if (TRUE_SIZE(h) > TCACHE_MAX_SIZE) {
+      free_block(a, h);
+      break;
+    }
+    tcache_push(h);
+  }
+  pthread_mutex_unlock(&a->mutex);
+
+  return to_return;
+} /* tcache_refill() */
+
+/*
+ * Fork handlers. Every lock in the allocator is taken before fork() and
+ * released again in both processes afterwards, so the child never inherits
+ * a lock held by a thread that does not exist there. The locks are taken in
+ * the order the allocator nests them: arenas before the heap.
+ */
+
+static void fork_prepare(void) {
+  for (int i = 0; i < g_arena_count; i++) {
+    pthread_mutex_lock(&g_arenas[i].mutex);
+  }
+  pthread_mutex_lock(&g_heap_mutex);
+  slab_lock_all();
+  pthread_mutex_lock(&g_stats_mutex);
+  profile_lock();
+} /* fork_prepare() */
+
+static void fork_unlock(void) {
+  profile_unlock();
+  pthread_mutex_unlock(&g_stats_mutex);
+  slab_unlock_all();
+  pthread_mutex_unlock(&g_heap_mutex);
+  for (int i = g_arena_count - 1; i >= 0; i--) {
+    pthread_mutex_unlock(&g_arenas[i].mutex);
+  }
+} /* fork_unlock() */
+
+/*
+ * Only the forking thread exists in the child, and the thread local storage
+ * of the others may be reused by new threads, so their counters are folded
+ * into the retired totals before the locks are released.
+ */
+
+static void fork_child(void) {
+  for (thread_stats *t = g_stats_threads; t != NULL; t = t->next) {
+    if (t == &g_thread_stats) {
+      continue;
+    }
+    g_stats_retired.lock_wait_ns += t->lock_wait_ns;
+    for (size_t i = 0; i < MALLOC_STATS_CLASS_COUNT; i++) {
+      g_stats_retired.allocations[i] += t->allocations[i];
+    }
+  }
+  g_stats_threads = NULL;
+  if (g_thread_stats.registered) {
+    g_thread_stats.next = NULL;
+    g_thread_stats.prev = NULL;
+    g_stats_threads = &g_thread_stats;
+  }
+
+  fork_unlock();
+} /* fork_child() */
+
+/*
+ * Returns false if the kernel has transparent huge pages turned off. The
+ * setting is read with plain system calls, since stdio would allocate.
+ */
+
+static bool huge_pages_available(void) {
+  int fd = open("/sys/kernel/mm/transparent_hugepage/enabled", O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  char setting[64];
+  ssize_t length = read(fd, setting, sizeof(setting) - 1);
+  close(fd);
+  if (length <= 0) {
+    return false;
+  }
+  setting[length] = '\0';
+  return strstr(setting, "[never]") == NULL;
+} /* huge_pages_available() */
+
+/*
+ * Sets up the globals, once. Only called through init().
+ */
+
+static void init_globals(void) {
+  /* Use one arena per CPU unless told to use fewer */
+
+  long arena_count = sysconf(_SC_NPROCESSORS_ONLN);
+  const char *arenas_env = getenv("MALLOC_ARENAS");
+  if (arenas_env != NULL) {
+    arena_count = atol(arenas_env);
+  }
+  if (arena_count < 1) {
+    arena_count = 1;
+  }
+  if (arena_count > MAX_ARENAS) {
+    arena_count = MAX_ARENAS;
+  }
+  g_arena_count = (int) arena_count;
+
+  /* Pick the fit policy: a number from 1 to 5 or "adaptive" */
+
+  int fit = FIT_ALGORITHM;
+  const char *fit_env = getenv("MALLOC_FIT");
+  if (fit_env != NULL) {
+    char *end = NULL;
+    long value = strtol(fit_env, &end, 10);
+    if (strcmp(fit_env, "adaptive") == 0) {
+      fit = FIT_ADAPTIVE;
+    }
+    else if ((end != fit_env) && (*end == '\0') && (value >= 1) &&
+             (value <= 5)) {
+      fit = (int) value;
+    }
+  }
+
+  bool address_ordered = ADDRESS_ORDERED;
+  const char *order_env = getenv("MALLOC_ADDRESS_ORDERED");
+  if (order_env != NULL) {
+    address_ordered = (atoi(order_env) != 0);
+  }
+
+  /* Initialize a mutex per arena for thread safety */
+
+  for (int i = 0; i < MAX_ARENAS; i++) {
+    pthread_mutex_init(&g_arenas[i].mutex, NULL);
+    g_arenas[i].index = i;
+    g_arenas[i].fit = (fit == FIT_ADAPTIVE) ? 2 : fit;
+    g_arenas[i].adaptive = (fit == FIT_ADAPTIVE);
+    g_arenas[i].address_ordered = address_ordered;
+  }
+
+  g_page_size = sysconf(_SC_PAGESIZE);
+
+  slab_init();
+
+  const char *threshold_env = getenv("MALLOC_MMAP_THRESHOLD");
+  if (threshold_env != NULL) {
+    g_mmap_threshold = strtoul(threshold_env, NULL, 0);
+  }
+
+  const char *trim_env = getenv("MALLOC_TRIM_THRESHOLD");
+  if (trim_env != NULL) {
+    g_trim_threshold = strtoul(trim_env, NULL, 0);
+  }
+
+  const char *reserve_env = getenv("MALLOC_HEAP_RESERVE");
+  if (reserve_env != NULL) {
+    g_heap_reserve = strtoul(reserve_env, NULL, 0);
+  }
+
+  const char *grow_min_env = getenv("MALLOC_GROW_MIN");
+  if (grow_min_env != NULL) {
+    g_grow_min = strtoul(grow_min_env, NULL, 0);
+  }
+  const char *grow_max_env = getenv("MALLOC_GROW_MAX");
+  if (grow_max_env != NULL) {
+    g_grow_max = strtoul(grow_max_env, NULL, 0);
+  }
+  if (g_grow_max < g_grow_min) {
+    g_grow_max = g_grow_min;
+  }
+
+  const char *profile_env = getenv("MALLOC_PROFILE_RATE");
+  profile_init((profile_env != NULL) ? strtoul(profile_env, NULL, 0) :
+                                       PROFILE_SAMPLE_RATE);
+
+  const char *huge_env = getenv("MALLOC_HUGEPAGES");
+  if ((huge_env != NULL) && (atoi(huge_env) != 0)) {
+    g_huge_pages = huge_pages_available();
+  }
+
+  /* Drain thread caches when their threads exit */
+
+  pthread_key_create(&g_tcache_key, tcache_thread_exit);
+  pthread_key_create(&g_stats_key, stats_retire);
+
+  pthread_atfork(fork_prepare, fork_unlock, fork_child);
+
+  /* Manually set printf buffer so it won't call malloc. Programs running */
+  /* on the preloaded library get to keep their own buffering. */
+
+#ifndef MALLOC_PRELOAD
+  setvbuf(stdout, NULL, _IONBF, 0);
+#endif
+
+  /* Record the starting address of the heap, which is otherwise the */
+  /* start of the first range an arena reserves */
+
+#ifdef HEAP_SBRK
+  g_base = sbrk(0);
+#endif
+
+  __atomic_store_n(&g_initialized, true, __ATOMIC_RELEASE);
+} /* init_globals() */
+
+/*
+ * Constructor that runs before main() to initialize the library, and is
+ * called by the entry points if they run first.
+ */
+
+static void init(void) {
+  pthread_once(&g_init_once, init_globals);
+} /* init() */
+
+/*
+ * Allocates size bytes, between 1 and SIZE_MAX / 2, for a request that has
+ * already been counted against the profiler's countdown. Sampled requests
+ * get a mapping of their own, so that my_free() only has to look for them
+ * among the mapped blocks, and are recorded with the profiler.
+ *
+ * Returns NULL with errno set to ENOMEM if there is no memory left.
+ */
+
+static void *allocate_memory(size_t size, bool sampled) {
+  /* small requests are carved out of slabs and carry no header, unless */
+  /* the slab range has run out */
+  if ((size <= SLAB_MAX_SIZE) && !sampled) {
+    void *slot = slab_malloc(size);
+    if (slot != NULL) {
+      return slot;
+    }
+  }
+
+  size_t block_size_needed = block_size_for(size);
+  header *found_block_header = NULL;
+
+  /* large requests get their own mapping straight from the OS */
+  if ((block_size_needed >= g_mmap_threshold) || sampled) {
+    found_block_header = allocate_mmapped_block(block_size_needed,
+                                                BLOCK_ALIGNMENT);
+  }
+  /* small requests are served from this thread's cache without locking */
+  else if (block_size_needed <= TCACHE_MAX_SIZE) {
+    found_block_header = tcache_pop(block_size_needed);
+    if (found_block_header == NULL) {
+      found_block_header = tcache_refill(block_size_needed);
+    }
+  }
+  else {
+    arena *a = thread_arena();
+    lock_arena(a);
+    found_block_header = fastbin_pop(a, block_size_needed);
+    if (found_block_header == NULL) {
+      found_block_header = get_block(a, block_size_needed);
+    }
+    pthread_mutex_unlock(&a->mutex);
+  }
+
+  if (found_block_header == NULL) {
+    errno = ENOMEM;
+    return NULL;
+  }
+
+  void *mem = ((char *) found_block_header) + BLOCK_HEADER_SIZE;
+  if (sampled) {
+    profile_record(mem, size);
+  }
+  return mem;
+} /* allocate_memory() */
+
+/*
+ * malloc
+ */
+
+void *my_malloc(size_t size) {
+  /* if requested size is 0, then return a null pointer */
+  if (size == 0) {
+    return NULL;
+  }
 
-      }
-    }
-  } while (true);
- 
-  pthread_mutex_unlock(&g_mutex);
+  /* requests this large can never be satisfied, and would overflow the */
+  /* size calculations below */
+  if (size > (SIZE_MAX >> 1)) {
+    errno = ENOMEM;
+    return NULL;
+  }
+
+  if (!g_initialized) {
+    init();
+  }
 
-  return NULL; 
+  stats_add(&local_stats()->allocations[stats_class(size)], 1);
+  return allocate_memory(size, profile_tick(size));
 } /* my_malloc() */
 
 /*
@@ -853,148 +2643,67 @@ void *my_malloc(size_t size) {
  */
 
 void my_free(void *p) {
-  pthread_mutex_lock(&g_mutex);
-
-  /* my code starts here */
-
   /* if a null pointer was given, do nothing */
   if (p == NULL) {
     return;
   }
-  else { 
-    header *block_to_free = (header *) ((char *)(p - ALLOC_HEADER_SIZE));
 
-    /* if the user is trying to free a block that is already free or was */
-    /* never allocated, there is an error */
-    if ((block_to_free->size & 0b111) == ((state) UNALLOCATED)) {
-    assert(false);
+  if (slab_owns(p)) {
+    slab_free(p);
     return;
-    }
-    /* if the user entered a valid block to free, we might need to coalesce */
-    else {
-      /* get the right and left neighbors of this block */
-      header *right_block = right_neighbor(block_to_free);
-      header *left_block = left_neighbor(block_to_free);
-
-      /* set this newly freed block to UNALLOCATED */
-      /* don't ask me why "|= (state) UNALLOCATED" didn't work here, */
-      /* i had to use TRUE_SIZE instead */
-      block_to_free->size = TRUE_SIZE(block_to_free);
-
-      /* if neither the right or left neighbors of this block are unallocated */
-      /* then simply insert this new block into the free list */
-      if (((right_block->size & 0b111) != ((state) UNALLOCATED)) &&
-          ((left_block->size & 0b111) != ((state) UNALLOCATED))) {
-
-        /* insert this block into the free list */
-        insert_free_block(block_to_free);
-      }
-      /* if the right neighbor is also an unallocated block, */
-      /* coalesce the blocks */ 
-      else if (((right_block->size & 0b111) == ((state) UNALLOCATED)) &&
-               ((left_block->size & 0b111) != ((state) UNALLOCATED))) {
-        /* remove the right block from the list */
-        /* if this block is the head of the list */
-        if (right_block == g_freelist_head) {
-          if (right_block->next == NULL) {
-            g_freelist_head = NULL;
-          }
-          else {
-            g_freelist_head = right_block->next;
-            g_freelist_head->prev = NULL;
-          }
-        }
-        else {
-          /* if the next pointer of the right block is NULL, then we */
-          /* simply have to set the next pointer of the prev block to NULL */
-          if (right_block->next == NULL) {
-            (right_block->prev)->next = NULL;
-            right_block->prev = NULL;
-          }
-          /* if the next pointer is not NULL, then we need to maintain */
-          /* the integrity of the list */
-          else {
-            right_block->prev->next = right_block->next;
-            right_block->next->prev = right_block->prev;
-            right_block->prev = NULL;
-            right_block->next = NULL;
-          }
-        }
-        
-        /* increase this block's size to include the block to the right */
-        block_to_free->size += TRUE_SIZE(right_block) + ALLOC_HEADER_SIZE;
+  }
 
-        /* update the left_size of block to the right of the right block */
-        right_neighbor(right_block)->left_size = TRUE_SIZE(block_to_free);
+  header *block_to_free = (header *) (((char *) p) - BLOCK_HEADER_SIZE);
 
-        /* insert this newly coalesced block into the free list */
-        insert_free_block(block_to_free);
+  /* if the user is trying to free a block that is already free or was */
+  /* never allocated, there is an error */
+  if (BLOCK_STATE(block_to_free) == ((state) UNALLOCATED)) {
+    assert(false);
+    return;
+  }
 
-        if (g_next_allocate == right_block) {
-          /* set g_next_allocate appropriately */
-          g_next_allocate = block_to_free;
-        }
+  /* mapped blocks go straight back to the OS */
+  if (block_to_free->size & MMAPPED) {
+    profile_forget(p);
+    __atomic_fetch_sub(&g_mmapped_bytes, mapping_size(block_to_free),
+                       __ATOMIC_RELAXED);
+    munmap(mapping_start(block_to_free), mapping_size(block_to_free));
+    return;
+  }
 
-      }
-      /* if the left neighbor is also an unallocated block, */
-      /* coalesce the blocks */
-      else if (((right_block->size & 0b111) != ((state) UNALLOCATED)) &&
-               ((left_block->size & 0b111) == ((state) UNALLOCATED))) {
-        /* increase the size of the left block to include the new block */
-        left_block->size += TRUE_SIZE(block_to_free) + ALLOC_HEADER_SIZE;
-
-        /* update the left size of the block to the right of the new block */
-        (right_neighbor(block_to_free))->left_size = TRUE_SIZE(left_block);
-      }
-      /* if both neighbors are unallocated, then coalesce all 3 */
-      else if (((right_block->size & 0b111) == ((state) UNALLOCATED)) &&
-               ((left_block->size & 0b111) == ((state) UNALLOCATED))) {
-        /* increase the size of the left block to include both the */
-        /* current block and the right block */
-        left_block->size += (TRUE_SIZE(block_to_free) + ALLOC_HEADER_SIZE) +
-                            (TRUE_SIZE(right_block) + ALLOC_HEADER_SIZE);
-                              
-        /* update the left size of the block on the right of the right */
-        /* block */
-        (right_neighbor(right_block))->left_size = TRUE_SIZE(left_block);
-        
-        /* remove the right neighbor from the free list since it's included */
-        /* in the left neighbor's block now */
-        if (right_block == g_freelist_head) {
-          if (right_block->next == NULL) {
-            g_freelist_head = NULL;
-          }
-          else {
-            g_freelist_head = right_block->next;
-            g_freelist_head->prev = NULL;
-          }
-        }
-        else {
-          /* if the next pointer of the right block is NULL, then we */
-          /* simply have to set the next pointer of the prev block to NULL */
-          if (right_block->next == NULL) {
-            (right_block->prev)->next = NULL;
-            right_block->prev = NULL;
-          }
-          /* if the next pointer is not NULL, then we need to maintain */
-          /* the integrity of the list */
-          else {
-            right_block->prev->next = right_block->next;
-            right_block->next->prev = right_block->prev;
-            right_block->prev = NULL;
-            right_block->next = NULL;
-          }
-        }
+  /* small blocks go back to this thread's cache without locking, and are */
+  /* only flushed to the freelist in batches once the cache is too full */
+  if (TRUE_SIZE(block_to_free) <= TCACHE_MAX_SIZE) {
+    size_t bin = tcache_bin(TRUE_SIZE(block_to_free));
 
-        /* set g_next_allocate appropriately */
-        if (g_next_allocate == right_block) {
-          g_next_allocate = left_block;
-        }
+    /* a block marked with this cache's key is most likely already in it */
+    if (block_to_free->prev == (header *) &g_tcache) {
+      for (header *h = g_tcache.bins[bin]; h != NULL; h = h->next) {
+        assert(h != block_to_free);
       }
     }
+
+    tcache_push(block_to_free);
+    if (g_tcache.counts[bin] > TCACHE_BIN_MAX) {
+      tcache_flush_bin(&g_tcache, bin, TCACHE_BIN_MAX / 2);
+    }
+    if (g_tcache.bytes > TCACHE_MAX_BYTES) {
+      tcache_destroy(&g_tcache);
+    }
+    return;
+  }
+
+  /* the block goes back to the arena it came from, which is not */
+  /* necessarily the calling thread's; another arena's blocks are queued */
+  /* for it instead of contending for its lock */
+  arena *a = arena_of(block_to_free);
+  if (a != thread_arena()) {
+    remote_free(a, block_to_free);
+    return;
   }
-  
-  pthread_mutex_unlock(&g_mutex);
+  lock_arena(a);
+  fastbin_free(a, block_to_free);
+  pthread_mutex_unlock(&a->mutex);
 
   /* after we are done coalescing or adding blocks, return */
   return;
@@ -1006,17 +2715,707 @@ void my_free(void *p) {
  */
 
 void *my_calloc(size_t nmemb, size_t size) {
-  return memset(my_malloc(size * nmemb), 0, size * nmemb);
+  /* refuse requests whose total size does not fit in a size_t */
+  if ((size != 0) && (nmemb > SIZE_MAX / size)) {
+    errno = ENOMEM;
+    return NULL;
+  }
+
+  void *mem = my_malloc(size * nmemb);
+  if (mem == NULL) {
+    return NULL;
+  }
+
+  /* fresh mappings from the OS are already zeroed */
+  if (slab_owns(mem) ||
+      !(((header *) (((char *) mem) - BLOCK_HEADER_SIZE))->size & MMAPPED)) {
+    memset(mem, 0, size * nmemb);
+  }
+  return mem;
 } /* my_calloc() */
 
 /*
- * Reallocates an allocated block to a new size and
- * copies the contents to the new block.
+ * Reallocates an allocated block to a new size. The block is resized in
+ * place when it is shrinking or its right neighbor is free and big enough,
+ * otherwise the contents are copied to a new block.
  */
 
 void *my_realloc(void *ptr, size_t size) {
-  void *mem = my_malloc(size);
-  memcpy(mem, ptr, size);
+  if (ptr == NULL) {
+    return my_malloc(size);
+  }
+  if (size == 0) {
+    my_free(ptr);
+    return NULL;
+  }
+  if (size > (SIZE_MAX >> 1)) {
+    errno = ENOMEM;
+    return NULL;
+  }
+
+  /* the resized block counts as a new allocation for the profiler, and */
+  /* if it is sampled it has to move to a mapping of its own */
+  bool sampled = profile_tick(size);
+
+  /* slots can't change size, so only moving to a different slot or to the */
+  /* heap is possible */
+  if (slab_owns(ptr)) {
+    size_t old_size = slab_usable_size(ptr);
+    if ((size <= old_size) && (block_size_for(size) >= old_size / 2) &&
+        !sampled) {
+      return ptr;
+    }
+
+    stats_add(&local_stats()->allocations[stats_class(size)], 1);
+    void *mem = allocate_memory(size, sampled);
+    if (mem == NULL) {
+      return NULL;
+    }
+    memcpy(mem, ptr, (old_size < size) ? old_size : size);
+    slab_free(ptr);
+    return mem;
+  }
+
+  header *h = (header *) (((char *) ptr) - BLOCK_HEADER_SIZE);
+  size_t old_size = TRUE_SIZE(h);
+  size_t block_size_needed = block_size_for(size);
+
+  if (h->size & MMAPPED) {
+    /* mapped blocks that stay above the threshold are remapped, which */
+    /* lets the kernel move the pages instead of copying them */
+    if (block_size_needed >= g_mmap_threshold) {
+      size_t offset = ((char *) h) - mapping_start(h);
+      size_t old_map_size = mapping_size(h);
+      size_t map_size = (offset + BLOCK_HEADER_SIZE + block_size_needed +
+                         g_page_size - 1) & ~(g_page_size - 1);
+      char *map = mremap(mapping_start(h), old_map_size, map_size,
+                         MREMAP_MAYMOVE);
+      if (map != MAP_FAILED) {
+        __atomic_fetch_add(&g_mmap_calls, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&g_mmapped_bytes, map_size - old_map_size,
+                           __ATOMIC_RELAXED);
+        header *new_h = (header *) (map + offset);
+        new_h->size = (map_size - offset - BLOCK_HEADER_SIZE) |
+                      (state) ALLOCATED | MMAPPED;
+        void *mem = ((char *) new_h) + BLOCK_HEADER_SIZE;
+        if (sampled) {
+          profile_forget(ptr);
+          profile_record(mem, size);
+        }
+        else {
+          profile_move(ptr, mem, size);
+        }
+        return mem;
+      }
+    }
+  }
+  else if (!sampled) {
+    arena *a = arena_of(h);
+    lock_arena(a);
+    bool resized = resize_block_in_place(a, h, block_size_needed);
+    pthread_mutex_unlock(&a->mutex);
+    if (resized) {
+      return ptr;
+    }
+  }
+
+  /* fall back to moving the data to a new block */
+  stats_add(&local_stats()->allocations[stats_class(size)], 1);
+  void *mem = allocate_memory(size, sampled);
+  if (mem == NULL) {
+    return NULL;
+  }
+  memcpy(mem, ptr, (old_size < size) ? old_size : size);
   my_free(ptr);
   return mem;
 } /* my_realloc() */
+
+/*
+ * Allocates size bytes at an address that is a multiple of alignment.
+ * Alignments up to BLOCK_ALIGNMENT are what my_malloc() gives anyway, larger
+ * ones are carved out of the calling thread's arena, or get a mapping of
+ * their own if they are above the mmap threshold.
+ */
+
+void *my_memalign(size_t alignment, size_t size) {
+  if ((alignment == 0) || ((alignment & (alignment - 1)) != 0)) {
+    errno = EINVAL;
+    return NULL;
+  }
+  if (size == 0) {
+    return NULL;
+  }
+  if ((size > (SIZE_MAX >> 1)) || (alignment > (SIZE_MAX >> 2))) {
+    errno = ENOMEM;
+    return NULL;
+  }
+
+  /* arena blocks are BLOCK_ALIGNMENT aligned, but slab slots sit at */
+  /* SLAB_SLOTS_OFFSET plus a multiple of their size, so the 24 byte slots */
+  /* are only 8 byte aligned. Rounding the size up to the alignment picks */
+  /* a slot size that is a multiple of it, and those slots are aligned to */
+  /* it, which keeps 16 byte aligned requests out of the 24 byte slots. */
+  if (alignment <= BLOCK_ALIGNMENT) {
+    return my_malloc((size + alignment - 1) & ~(alignment - 1));
+  }
+
+  if (!g_initialized) {
+    init();
+  }
+  stats_add(&local_stats()->allocations[stats_class(size)], 1);
+
+  /* sampled requests get a mapping of their own, as in my_malloc() */
+  bool sampled = profile_tick(size);
+
+  size_t block_size_needed = block_size_for(size);
+  header *h = NULL;
+  if ((block_size_needed + alignment >= g_mmap_threshold) || sampled) {
+    h = allocate_mmapped_block(block_size_needed, alignment);
+  }
+  else {
+    arena *a = thread_arena();
+    lock_arena(a);
+    h = get_aligned_block(a, block_size_needed, alignment);
+    pthread_mutex_unlock(&a->mutex);
+  }
+
+  if (h == NULL) {
+    errno = ENOMEM;
+    return NULL;
+  }
+
+  void *mem = ((char *) h) + BLOCK_HEADER_SIZE;
+  if (sampled) {
+    profile_record(mem, size);
+  }
+  return mem;
+} /* my_memalign() */
+
+/*
+ * posix_memalign(): alignment must also be a multiple of sizeof(void *),
+ * and errors are returned instead of being stored in errno.
+ */
+
+int my_posix_memalign(void **memptr, size_t alignment, size_t size) {
+  if ((alignment % sizeof(void *)) != 0) {
+    return EINVAL;
+  }
+
+  int saved_errno = errno;
+  void *mem = my_memalign(alignment, size);
+  int error = errno;
+  errno = saved_errno;
+  if ((mem == NULL) && (size != 0)) {
+    return error;
+  }
+  *memptr = mem;
+  return 0;
+} /* my_posix_memalign() */
+
+/*
+ * C11 aligned_alloc(). Any power of two alignment is accepted, and size
+ * need not be a multiple of it.
+ */
+
+void *my_aligned_alloc(size_t alignment, size_t size) {
+  return my_memalign(alignment, size);
+} /* my_aligned_alloc() */
+
+/*
+ * Allocates count blocks of size bytes and stores them in out. Arena blocks
+ * are carved out of one free block with a single search under a single
+ * lock; slab slots and mapped blocks are allocated one at a time.
+ *
+ * Returns the number of blocks allocated, which is less than count only if
+ * there is no more memory, in which case errno is set to ENOMEM.
+ */
+
+size_t my_malloc_batch(size_t size, size_t count, void **out) {
+  if ((size == 0) || (count == 0)) {
+    return 0;
+  }
+  if (size > (SIZE_MAX >> 1)) {
+    errno = ENOMEM;
+    return 0;
+  }
+
+  size_t block_size_needed = block_size_for(size);
+  bool run = (size > SLAB_MAX_SIZE) && (block_size_needed < g_mmap_threshold);
+  if (run &&
+      (count > (SIZE_MAX >> 1) / (block_size_needed + BLOCK_HEADER_SIZE))) {
+    errno = ENOMEM;
+    return 0;
+  }
+
+  if (!g_initialized) {
+    init();
+  }
+  stats_add(&local_stats()->allocations[stats_class(size)], count);
+
+  /* every block counts against the profiler's countdown, and the sampled */
+  /* ones are mapped on their own at the end of out */
+  size_t unsampled = count;
+  for (size_t i = 0; i < count; i++) {
+    if (profile_tick(size)) {
+      unsampled--;
+    }
+  }
+
+  size_t allocated = 0;
+  if (run && (unsampled > 0)) {
+    arena *a = thread_arena();
+    lock_arena(a);
+    if (get_block_run(a, block_size_needed, unsampled, out)) {
+      allocated = unsampled;
+    }
+    pthread_mutex_unlock(&a->mutex);
+  }
+
+  /* everything else, or a run that didn't fit, goes block by block */
+  for (; allocated < count; allocated++) {
+    out[allocated] = allocate_memory(size, allocated >= unsampled);
+    if (out[allocated] == NULL) {
+      return allocated;
+    }
+  }
+  return count;
+} /* my_malloc_batch() */
+
+/*
+ * Frees count blocks. Consecutive arena blocks from the same arena are
+ * freed under a single lock and go straight back to the freelist, so a run
+ * from my_malloc_batch() coalesces back into one free block.
+ */
+
+void my_free_batch(void **ptrs, size_t count) {
+  arena *locked = NULL;
+  for (size_t i = 0; i < count; i++) {
+    void *p = ptrs[i];
+    if (p == NULL) {
+      continue;
+    }
+
+    header *h = (header *) (((char *) p) - BLOCK_HEADER_SIZE);
+    if (slab_owns(p) || (h->size & MMAPPED)) {
+      my_free(p);
+      continue;
+    }
+    assert(BLOCK_STATE(h) == ((state) ALLOCATED));
+
+    arena *a = arena_of(h);
+    if (a != locked) {
+      if (locked != NULL) {
+        pthread_mutex_unlock(&locked->mutex);
+      }
+      lock_arena(a);
+      locked = a;
+    }
+    free_block(a, h);
+  }
+  if (locked != NULL) {
+    pthread_mutex_unlock(&locked->mutex);
+  }
+} /* my_free_batch() */
+
+/*
+ * Returns the number of usable bytes in the block at p.
+ */
+
+size_t my_malloc_usable_size(void *p) {
+  if (p == NULL) {
+    return 0;
+  }
+  if (slab_owns(p)) {
+    return slab_usable_size(p);
+  }
+  return TRUE_SIZE((header *) (((char *) p) - BLOCK_HEADER_SIZE));
+} /* my_malloc_usable_size() */
+
+/*
+ * Gives as much free memory as possible back to the OS: the calling
+ * thread's cache is flushed, the fastbins are consolidated, the top of the
+ * heap is cut down to pad bytes of free space and the pages inside every
+ * other free block are released.
+ *
+ * Returns 1 if any memory was released, 0 otherwise.
+ */
+
+int my_malloc_trim(size_t pad) {
+  if (!g_initialized) {
+    init();
+  }
+
+  tcache_destroy(&g_tcache);
+
+  bool released = false;
+  for (int i = 0; i < g_arena_count; i++) {
+    arena *a = &g_arenas[i];
+    pthread_mutex_lock(&a->mutex);
+    drain_remote_frees(a);
+    consolidate_fastbins(a);
+    released |= trim_top(a, pad);
+    visit_free_blocks(a, release_block_pages, &released);
+    pthread_mutex_unlock(&a->mutex);
+  }
+  return released ? 1 : 0;
+} /* my_malloc_trim() */
+
+/*
+ * visit_free_blocks() callback that adds a free block to the stats.
+ */
+
+static void stats_free_block(header *h, void *stats) {
+  malloc_stats *m = (malloc_stats *) stats;
+  m->bytes_free += TRUE_SIZE(h);
+  m->free_blocks++;
+  if (TRUE_SIZE(h) > m->largest_free_block) {
+    m->largest_free_block = TRUE_SIZE(h);
+  }
+} /* stats_free_block() */
+
+/*
+ * Returns a snapshot of the allocator's counters. Blocks sitting in thread
+ * caches and fastbins count as in use, and the per-thread counters are read
+ * while other threads keep updating them, so the totals are only exact when
+ * no other thread is allocating.
+ */
+
+malloc_stats my_malloc_stats(void) {
+  if (!g_initialized) {
+    init();
+  }
+
+  malloc_stats m;
+  memset(&m, 0, sizeof(m));
+
+  pthread_mutex_lock(&g_stats_mutex);
+  thread_stats total = g_stats_retired;
+  for (thread_stats *t = g_stats_threads; t != NULL; t = t->next) {
+    total.lock_wait_ns += __atomic_load_n(&t->lock_wait_ns, __ATOMIC_RELAXED);
+    for (size_t i = 0; i < MALLOC_STATS_CLASS_COUNT; i++) {
+      total.allocations[i] += __atomic_load_n(&t->allocations[i],
+                                              __ATOMIC_RELAXED);
+    }
+  }
+  pthread_mutex_unlock(&g_stats_mutex);
+
+  m.lock_wait_ns = total.lock_wait_ns;
+  for (size_t i = 0; i < MALLOC_STATS_CLASS_COUNT; i++) {
+    m.allocations[i] = total.allocations[i];
+  }
+
+  pthread_mutex_lock(&g_heap_mutex);
+  m.sbrk_calls = g_sbrk_calls;
+  m.bytes_from_os = g_sbrk_bytes;
+  pthread_mutex_unlock(&g_heap_mutex);
+
+  size_t mmapped_bytes = __atomic_load_n(&g_mmapped_bytes, __ATOMIC_RELAXED);
+  m.mmap_calls = __atomic_load_n(&g_mmap_calls, __ATOMIC_RELAXED);
+  m.bytes_from_os += mmapped_bytes + slab_os_bytes();
+  m.bytes_in_use = mmapped_bytes + slab_bytes_in_use();
+
+  for (int i = 0; i < g_arena_count; i++) {
+    arena *a = &g_arenas[i];
+    pthread_mutex_lock(&a->mutex);
+    m.bytes_in_use += a->bytes_in_use;
+    visit_free_blocks(a, stats_free_block, &m);
+    pthread_mutex_unlock(&a->mutex);
+  }
+
+  /* how much of the free memory can't be handed out as one block */
+  if (m.bytes_free != 0) {
+    m.fragmentation = 1.0 - (((double) m.largest_free_block) /
+                             ((double) m.bytes_free));
+  }
+  return m;
+} /* my_malloc_stats() */
+
+/*
+ * Set of the blocks parked in the arenas' fastbins and remote free queues,
+ * which look allocated to a heap walk. Open addressing with a power of two
+ * number of slots, mapped from the OS so the walk never allocates.
+ */
+
+typedef struct cached_set {
+  header **slots;
+  size_t mask;
+  size_t count;
+  size_t map_size;
+} cached_set;
+
+static inline size_t cached_slot(cached_set *set, header *h) {
+  return ((((uintptr_t) h) * 0x9e3779b97f4a7c15ULL) >> 32) & set->mask;
+} /* cached_slot() */
+
+static void cached_add(cached_set *set, header *h) {
+  /* blocks queued by other threads while the set is filled may not fit */
+  if (set->count >= set->mask / 2) {
+    return;
+  }
+  set->count++;
+
+  size_t slot = cached_slot(set, h);
+  while (set->slots[slot] != NULL) {
+    slot = (slot + 1) & set->mask;
+  }
+  set->slots[slot] = h;
+} /* cached_add() */
+
+static bool cached_contains(cached_set *set, header *h) {
+  if (set->slots == NULL) {
+    return false;
+  }
+  for (size_t slot = cached_slot(set, h); set->slots[slot] != NULL;
+       slot = (slot + 1) & set->mask) {
+    if (set->slots[slot] == h) {
+      return true;
+    }
+  }
+  return false;
+} /* cached_contains() */
+
+/*
+ * Fills *set with the blocks of every arena's fastbins and remote free
+ * queue. The caller must hold every arena's mutex, which keeps the queues
+ * from being drained. Returns false if the set can't be mapped.
+ */
+
+static bool cached_collect(cached_set *set) {
+  size_t count = 0;
+  for (int i = 0; i < g_arena_count; i++) {
+    arena *a = &g_arenas[i];
+    for (size_t bin = 0; bin < FASTBIN_COUNT; bin++) {
+      for (header *h = a->fastbins[bin]; h != NULL; h = h->next) {
+        count++;
+      }
+    }
+    for (header *h = __atomic_load_n(&a->remote_frees, __ATOMIC_ACQUIRE);
+         h != NULL; h = h->next) {
+      count++;
+    }
+  }
+
+  memset(set, 0, sizeof(*set));
+  if (count == 0) {
+    return true;
+  }
+
+  /* keep the set at most half full, leaving room for blocks other */
+  /* threads queue while it is being filled */
+  size_t slots = 64;
+  while (slots < 2 * (count + REMOTE_FREE_MAX)) {
+    slots *= 2;
+  }
+  set->map_size = (slots * sizeof(header *) + g_page_size - 1) &
+                  ~(g_page_size - 1);
+  set->slots = mmap(NULL, set->map_size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (set->slots == MAP_FAILED) {
+    set->slots = NULL;
+    return false;
+  }
+  set->mask = slots - 1;
+
+  for (int i = 0; i < g_arena_count; i++) {
+    arena *a = &g_arenas[i];
+    for (size_t bin = 0; bin < FASTBIN_COUNT; bin++) {
+      for (header *h = a->fastbins[bin]; h != NULL; h = h->next) {
+        cached_add(set, h);
+      }
+    }
+    for (header *h = __atomic_load_n(&a->remote_frees, __ATOMIC_ACQUIRE);
+         h != NULL; h = h->next) {
+      cached_add(set, h);
+    }
+  }
+  return true;
+} /* cached_collect() */
+
+/*
+ * Walks every chunk of every arena in address order, by going through the
+ * chunk map for pages that start a chunk, and records each block in
+ * blocks[] if it is not NULL. The caller must hold every arena's mutex.
+ *
+ * Returns the number of blocks, fenceposts included.
+ */
+
+static size_t walk_heap(cached_set *cached, heap_snapshot_block *blocks) {
+  size_t count = 0;
+  uintptr_t page_count = (uintptr_t) 1 << (CHUNK_MAP_ROOT_BITS +
+                                           CHUNK_MAP_LEAF_BITS);
+  uintptr_t page = 0;
+  while (page < page_count) {
+    uint8_t *leaf = g_chunk_map[page >> CHUNK_MAP_LEAF_BITS];
+    if (leaf == NULL) {
+      page = (page | (CHUNK_MAP_LEAF_SIZE - 1)) + 1;
+      continue;
+    }
+    uint8_t owner = leaf[page & (CHUNK_MAP_LEAF_SIZE - 1)];
+    header *h = (header *) (page << CHUNK_MAP_PAGE_SHIFT);
+    if ((owner == 0) || (BLOCK_STATE(h) != ((state) FENCEPOST))) {
+      page++;
+      continue;
+    }
+
+    /* from the left fencepost to the right one, which ends the chunk */
+    bool left_fence = true;
+    for (;;) {
+      size_t size = BLOCK_HEADER_SIZE;
+      int block_state = HEAP_BLOCK_FENCEPOST;
+      if (BLOCK_STATE(h) == ((state) UNALLOCATED)) {
+        size += TRUE_SIZE(h);
+        block_state = HEAP_BLOCK_FREE;
+      }
+      else if (BLOCK_STATE(h) != ((state) FENCEPOST)) {
+        size += TRUE_SIZE(h);
+        block_state = cached_contains(cached, h) ? HEAP_BLOCK_CACHED :
+                                                   HEAP_BLOCK_ALLOCATED;
+      }
+      if (blocks != NULL) {
+        blocks[count].address = HEAP_BLOCK_PACK(h, owner - 1, block_state);
+        blocks[count].size = size;
+      }
+      count++;
+
+      if ((block_state == HEAP_BLOCK_FENCEPOST) && !left_fence) {
+        break;
+      }
+      left_fence = false;
+      h = (header *) (((char *) h) + size);
+    }
+
+    /* the next chunk can start no earlier than the page after this one */
+    page = (((uintptr_t) h) + BLOCK_HEADER_SIZE + g_page_size - 1) >>
+           CHUNK_MAP_PAGE_SHIFT;
+  }
+  return count;
+} /* walk_heap() */
+
+/*
+ * Writes a snapshot of every block in the arenas to the file at path, in
+ * the format described in heap_snapshot.h. The arenas are locked only
+ * while the blocks are copied into a buffer, not while it is written out.
+ *
+ * Returns 0 on success, or -1 with errno set.
+ */
+
+int my_malloc_snapshot(const char *path) {
+  if (!g_initialized) {
+    init();
+  }
+
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    return -1;
+  }
+
+  for (int i = 0; i < g_arena_count; i++) {
+    pthread_mutex_lock(&g_arenas[i].mutex);
+  }
+
+  cached_set cached;
+  bool collected = cached_collect(&cached);
+  size_t count = walk_heap(&cached, NULL);
+  size_t buffer_size = (count * sizeof(heap_snapshot_block) + g_page_size -
+                        1) & ~(g_page_size - 1);
+  heap_snapshot_block *blocks = MAP_FAILED;
+  if (collected && (buffer_size != 0)) {
+    blocks = mmap(NULL, buffer_size, PROT_READ | PROT_WRITE,
+                  MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  }
+  if (blocks != MAP_FAILED) {
+    walk_heap(&cached, blocks);
+  }
+
+  for (int i = g_arena_count - 1; i >= 0; i--) {
+    pthread_mutex_unlock(&g_arenas[i].mutex);
+  }
+  if (cached.slots != NULL) {
+    munmap(cached.slots, cached.map_size);
+  }
+  if ((blocks == MAP_FAILED) && (count != 0)) {
+    close(fd);
+    errno = ENOMEM;
+    return -1;
+  }
+
+  heap_snapshot_header snapshot;
+  memset(&snapshot, 0, sizeof(snapshot));
+  memcpy(snapshot.magic, HEAP_SNAPSHOT_MAGIC, sizeof(snapshot.magic));
+  snapshot.block_count = count;
+  snapshot.page_size = g_page_size;
+  snapshot.header_size = BLOCK_HEADER_SIZE;
+  snapshot.mmapped_bytes = __atomic_load_n(&g_mmapped_bytes,
+                                           __ATOMIC_RELAXED);
+  snapshot.slab_bytes_in_use = slab_bytes_in_use();
+  snapshot.slab_bytes = slab_os_bytes();
+  snapshot.arena_count = g_arena_count;
+
+  /* write the header and then the blocks, picking up after short writes */
+  bool failed = false;
+  const char *parts[2] = { (const char *) &snapshot, (const char *) blocks };
+  size_t lengths[2] = { sizeof(snapshot), count * sizeof(*blocks) };
+  for (int part = 0; (part < 2) && !failed; part++) {
+    size_t written = 0;
+    while (written < lengths[part]) {
+      ssize_t n = write(fd, parts[part] + written, lengths[part] - written);
+      if (n < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        failed = true;
+        break;
+      }
+      written += n;
+    }
+  }
+  if (blocks != MAP_FAILED) {
+    munmap(blocks, buffer_size);
+  }
+  if (failed) {
+    int error = errno;
+    close(fd);
+    errno = error;
+    return -1;
+  }
+  return close(fd);
+} /* my_malloc_snapshot() */
+
+/*
+ * Reports the fit policy of arena arena_index in *policy.
+ *
+ * Returns the number of arenas in use, or -1 if arena_index is not one of
+ * them, in which case *policy is left alone.
+ */
+
+int my_malloc_policy(int arena_index, malloc_policy *policy) {
+  if (!g_initialized) {
+    init();
+  }
+  if ((arena_index < 0) || (arena_index >= g_arena_count)) {
+    return -1;
+  }
+
+  arena *a = &g_arenas[arena_index];
+  pthread_mutex_lock(&a->mutex);
+  policy->fit = a->fit;
+  policy->adaptive = a->adaptive;
+  policy->address_ordered = a->address_ordered;
+  policy->switches = a->fit_switches;
+  policy->switch_reason = a->switch_reason;
+  policy->search_length = a->search_length;
+  policy->fragmentation = a->fragmentation;
+  pthread_mutex_unlock(&a->mutex);
+  return g_arena_count;
+} /* my_malloc_policy() */
+
+/*
+ * Writes the live sampled allocations to the file at path.
+ */
+
+int my_malloc_dump_profile(const char *path) {
+  if (!g_initialized) {
+    init();
+  }
+  return profile_dump(path);
+} /* my_malloc_dump_profile() */
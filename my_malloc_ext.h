@@ -0,0 +1,153 @@
+#ifndef MY_MALLOC_EXT_H
+#define MY_MALLOC_EXT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Extensions to the interface in my_malloc.h.
+ */
+
+/*
+ * Gives free memory back to the OS: the top of each arena is cut down to
+ * pad bytes of free space, and the whole pages inside every other large
+ * free block are released. Returns 1 if any memory was released, 0
+ * otherwise.
+ */
+
+int my_malloc_trim(size_t pad);
+
+/*
+ * Allocates size bytes at an address that is a multiple of alignment, a
+ * power of two. Sets errno to EINVAL and returns NULL for any other
+ * alignment. The block is freed with my_free().
+ */
+
+void *my_memalign(size_t alignment, size_t size);
+
+/*
+ * posix_memalign() and aligned_alloc() on top of my_memalign().
+ * my_posix_memalign() also requires alignment to be a multiple of
+ * sizeof(void *) and returns an error number instead of setting errno.
+ */
+
+int my_posix_memalign(void **memptr, size_t alignment, size_t size);
+void *my_aligned_alloc(size_t alignment, size_t size);
+
+/*
+ * Allocate count blocks of size bytes into out, and free count blocks,
+ * taking the arena lock once per batch instead of once per block.
+ * my_malloc_batch() returns how many blocks it allocated, which is less
+ * than count only when memory runs out.
+ */
+
+size_t my_malloc_batch(size_t size, size_t count, void **out);
+void my_free_batch(void **ptrs, size_t count);
+
+/*
+ * Bump arenas, for allocations that are all freed together. Allocating
+ * moves a cursor through large blocks taken from the heap, my_arena_reset()
+ * frees everything allocated so far while keeping the blocks for reuse, and
+ * my_arena_destroy() returns the blocks to the heap. my_arena_alloc() takes
+ * a power of two alignment, or 0 for 16 bytes. An arena must only be used
+ * by one thread at a time.
+ */
+
+typedef struct bump_arena bump_arena;
+
+bump_arena *my_arena_create(size_t initial_size);
+void *my_arena_alloc(bump_arena *arena, size_t size, size_t alignment);
+void my_arena_reset(bump_arena *arena);
+void my_arena_destroy(bump_arena *arena);
+
+/*
+ * Returns the number of bytes that can be used in the block at p, which is
+ * at least the size it was allocated with.
+ */
+
+size_t my_malloc_usable_size(void *p);
+
+/*
+ * Number of request size classes counted by my_malloc_stats(). Class 0
+ * holds requests of up to 8 bytes and each class after that doubles the
+ * limit; the last class also holds everything larger.
+ */
+
+#define MALLOC_STATS_CLASS_COUNT (24)
+
+typedef struct malloc_stats {
+  /* Bytes of the blocks handed out and not yet freed, headers included. */
+  /* Blocks kept in thread caches and fastbins for reuse count as */
+  /* handed out. */
+  size_t bytes_in_use;
+
+  /* Bytes in free blocks of the arenas */
+  size_t bytes_free;
+
+  /* Bytes currently obtained from the OS with sbrk and mmap */
+  size_t bytes_from_os;
+
+  /* Calls that grew or shrank the heap, and large blocks mapped */
+  size_t sbrk_calls;
+  size_t mmap_calls;
+
+  /* Number of free blocks, and the size of the largest one */
+  size_t free_blocks;
+  size_t largest_free_block;
+
+  /* 1 - largest_free_block / bytes_free: 0 when the free memory is one */
+  /* block, close to 1 when it is scattered in small pieces */
+  double fragmentation;
+
+  /* Number of allocations per size class */
+  size_t allocations[MALLOC_STATS_CLASS_COUNT];
+
+  /* Total time threads spent waiting for a contended arena lock */
+  uint64_t lock_wait_ns;
+} malloc_stats;
+
+malloc_stats my_malloc_stats(void);
+
+typedef struct malloc_policy {
+  /* Fit policy in use: 1 first fit, 2 next fit, 3 best fit, 4 worst fit, */
+  /* 5 TLSF */
+  int fit;
+
+  /* Nonzero if the arena switches between next fit and best fit itself */
+  int adaptive;
+
+  /* Nonzero if first, next and worst fit keep free blocks in address */
+  /* order */
+  int address_ordered;
+
+  /* Number of switches so far, and why the last one happened (NULL if */
+  /* there was none) */
+  size_t switches;
+  const char *switch_reason;
+
+  /* Blocks examined per search and fragmentation of the free memory, as */
+  /* of the adaptive policy's last complete window */
+  double search_length;
+  double fragmentation;
+} malloc_policy;
+
+int my_malloc_policy(int arena_index, malloc_policy *policy);
+
+/*
+ * Writes the sampled allocations that are still live to the file at path,
+ * in the heap profile format pprof reads. Allocations are sampled on
+ * average once every MALLOC_PROFILE_RATE bytes. Returns 0 on success, or -1
+ * with errno set.
+ */
+
+int my_malloc_dump_profile(const char *path);
+
+/*
+ * Writes the address, size and state of every block in the arenas to the
+ * file at path, in the binary format of heap_snapshot.h, for tools/heapmap
+ * to analyze. Returns 0 on success, or -1 with errno set.
+ */
+
+int my_malloc_snapshot(const char *path);
+
+#endif // MY_MALLOC_EXT_H
@@ -0,0 +1,98 @@
+#define _GNU_SOURCE
+
+#include <my_malloc.h>
+#include <my_malloc_ext.h>
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+
+/*
+ * The C library's allocation functions, implemented on top of my_malloc and
+ * built into libmymalloc.so so that any dynamically linked program can be
+ * run on the allocator without recompiling it:
+ *
+ *   LD_PRELOAD=./libmymalloc.so program
+ *
+ * The C library promises a little more than the my_ functions do: malloc(0)
+ * returns a pointer that can be passed to free(), and posix_memalign()
+ * reports errors through its return value instead of errno.
+ */
+
+/*
+ * Returns the size to ask my_malloc() for. The C library aligns anything
+ * larger than 8 bytes to 16, but the 24 byte slab slots are only 8 byte
+ * aligned, so those requests take a 32 byte slot instead.
+ */
+
+static inline size_t request_size(size_t size) {
+  if (size == 0) {
+    return 1;
+  }
+  if ((size > 16) && (size < 32)) {
+    return 32;
+  }
+  return size;
+} /* request_size() */
+
+void *malloc(size_t size) {
+  return my_malloc(request_size(size));
+} /* malloc() */
+
+void free(void *p) {
+  my_free(p);
+} /* free() */
+
+void *calloc(size_t nmemb, size_t size) {
+  if ((size != 0) && (nmemb > SIZE_MAX / size)) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  return my_calloc(1, request_size(nmemb * size));
+} /* calloc() */
+
+void *realloc(void *p, size_t size) {
+  if (p == NULL) {
+    return malloc(size);
+  }
+  if (size == 0) {
+    return my_realloc(p, 0);
+  }
+  return my_realloc(p, request_size(size));
+} /* realloc() */
+
+void *reallocarray(void *p, size_t nmemb, size_t size) {
+  if ((size != 0) && (nmemb > SIZE_MAX / size)) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  return realloc(p, nmemb * size);
+} /* reallocarray() */
+
+void *memalign(size_t alignment, size_t size) {
+  return my_memalign(alignment, (size == 0) ? 1 : size);
+} /* memalign() */
+
+void *aligned_alloc(size_t alignment, size_t size) {
+  return my_aligned_alloc(alignment, (size == 0) ? 1 : size);
+} /* aligned_alloc() */
+
+int posix_memalign(void **memptr, size_t alignment, size_t size) {
+  return my_posix_memalign(memptr, alignment, (size == 0) ? 1 : size);
+} /* posix_memalign() */
+
+void *valloc(size_t size) {
+  return memalign(sysconf(_SC_PAGESIZE), size);
+} /* valloc() */
+
+void *pvalloc(size_t size) {
+  size_t page_size = sysconf(_SC_PAGESIZE);
+  if (size > SIZE_MAX - page_size) {
+    errno = ENOMEM;
+    return NULL;
+  }
+  return memalign(page_size, (size + page_size - 1) & ~(page_size - 1));
+} /* pvalloc() */
+
+size_t malloc_usable_size(void *p) {
+  return my_malloc_usable_size(p);
+} /* malloc_usable_size() */
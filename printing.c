@@ -5,6 +5,7 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <arena.h>
 #include <my_malloc.h>
 #include <printing.h>
 
@@ -39,13 +40,15 @@ void print_list(header *block) {
  * @return A string representing the allocation status
  */
 static inline const char *allocated_to_string(size_t size) {
-  switch(size & 0b111) {
+  switch(size & STATE_MASK) {
     case (state) UNALLOCATED: 
       return "false";
     case (state) ALLOCATED:
       return "true";
     case (state) FENCEPOST:
       return "fencepost";
+    case (state) ALLOCATED | MMAPPED:
+      return "mmapped";
   }
   assert(false);
 }
@@ -70,11 +73,12 @@ static void print_color(header *block) {
     return;
   }
 
-  switch(block->size & 0b111) {
+  switch(BLOCK_STATE(block)) {
     case (state) UNALLOCATED:
       printf("\033[0;32m");
       break;
     case (state) ALLOCATED:
+    case (state) ALLOCATED | MMAPPED:
       printf("\033[0;34m");
       break;
     case (state) FENCEPOST:
@@ -122,7 +126,9 @@ void print_object(header *block) {
   print_pointer(block);
   puts("");
   printf("\tsize: %zd\n", TRUE_SIZE(block));
+#ifndef COMPACT_HEADERS
   printf("\tleft_size: %zd\n", block->left_size);
+#endif
   printf("\tallocated: %s\n", allocated_to_string(block->size));
   if (!(block->size & (state) ALLOCATED) && 
       !(block->size & (state) FENCEPOST)) {
@@ -146,13 +152,16 @@ void print_object(header *block) {
  */
 void print_status(header *block) {
   print_color(block);
-  switch(block->size & 0b111) {
+  switch(BLOCK_STATE(block)) {
     case (state) UNALLOCATED:
       printf("[U]");
       break;
     case (state) ALLOCATED:
       printf("[A]");
       break;
+    case (state) ALLOCATED | MMAPPED:
+      printf("[M]");
+      break;
     case (state) FENCEPOST:
       printf("[F]");
       break;
@@ -161,7 +170,19 @@ void print_status(header *block) {
 }
 
 /**
- * @brief print the full freelist
+ * @brief visit_free_blocks() callback that prints one free block
+ *
+ * @param block The block to print
+ * @param pf Pointer to the function to perform the header printing
+ */
+static void print_free_block(header *block, void *pf) {
+  (*(printFormatter *) pf)(block);
+  puts("");
+}
+
+/**
+ * @brief print the free blocks of every arena, from whichever index its fit
+ * policy keeps them in
  *
  * @param pf Function to perform the header printing
  */
@@ -170,11 +191,8 @@ void freelist_print(printFormatter pf) {
     return;
   }
 
-  header *freelist = g_freelist_head;
-  printf("%p\n%p\n", freelist, freelist->next);
-  do {
-    pf(freelist);
-    puts("");
-  } while ((freelist = freelist->next) != NULL);
+  for (int i = 0; i < g_arena_count; i++) {
+    visit_free_blocks(&g_arenas[i], print_free_block, &pf);
+  }
   fflush(stdout);
 }
@@ -0,0 +1,373 @@
+#define _GNU_SOURCE
+
+#include <profile.h>
+#include <errno.h>
+#include <execinfo.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/*
+ * Sampling heap profiler. Each thread counts down the bytes it allocates
+ * from an exponentially distributed starting point with a mean of the
+ * sampling rate, so on average one allocation is sampled per rate bytes and
+ * large allocations are proportionally more likely to be. A sampled
+ * allocation's stack is captured with backtrace() and kept in a table keyed
+ * by its address until it is freed.
+ *
+ * my_malloc() gives sampled allocations a mapping of their own, so my_free()
+ * only has to look for them among mapped blocks, and unsampled calls pay for
+ * nothing but the countdown. profile_dump() writes the live samples in the
+ * legacy heap profile format pprof reads, which scales the samples back up
+ * to estimated totals using the rate in its header.
+ */
+
+/* Buckets in the table of live samples, a power of two */
+#define PROFILE_BUCKETS (4096)
+
+/* Bytes of sample records mapped from the OS at a time */
+#define PROFILE_POOL_SIZE ((size_t) 64 * 1024)
+
+typedef struct sample {
+  struct sample *next;
+  void *address;
+  size_t size;
+  int depth;
+  void *stack[PROFILE_MAX_DEPTH];
+} sample;
+
+__thread int64_t g_profile_countdown = 0;
+
+/* State of the calling thread's random number generator, 0 until seeded */
+static __thread uint64_t g_profile_rng = 0;
+
+/* Whether the calling thread's countdown has been started. The first one */
+/* runs out on the thread's first allocation, which is not sampled. */
+static __thread bool g_profile_started = false;
+
+/* Set while the calling thread is inside the profiler, so allocations the */
+/* profiler itself makes, like backtrace() loading its unwinder, are never */
+/* sampled */
+static __thread bool g_profile_busy = false;
+
+/* Average bytes between samples, 0 when the profiler is off */
+static size_t g_profile_rate = 0;
+
+/* Live samples and their unused records, protected by g_profile_mutex */
+static pthread_mutex_t g_profile_mutex = PTHREAD_MUTEX_INITIALIZER;
+static sample *g_samples[PROFILE_BUCKETS];
+static sample *g_free_samples = NULL;
+
+/* Number of live samples, read without the lock to skip empty lookups */
+static size_t g_sample_count = 0;
+
+/*
+ * Sets the average number of bytes between samples. 0 turns the profiler
+ * off.
+ */
+
+void profile_init(size_t rate) {
+  g_profile_rate = rate;
+} /* profile_init() */
+
+/*
+ * Returns -ln(u) for u uniformly distributed in (0, 1], an exponentially
+ * distributed value with a mean of 1. The logarithm is approximated with a
+ * series that is accurate to within 1e-5, which is plenty for sampling and
+ * keeps the allocator from needing libm.
+ */
+
+static double exponential_random(void) {
+  if (g_profile_rng == 0) {
+    g_profile_rng = (((uintptr_t) &g_profile_rng) * 0x9e3779b97f4a7c15ULL) |
+                    1;
+  }
+  g_profile_rng ^= g_profile_rng >> 12;
+  g_profile_rng ^= g_profile_rng << 25;
+  g_profile_rng ^= g_profile_rng >> 27;
+  uint64_t bits = ((g_profile_rng * 2685821657736338717ULL) >> 11) | 1;
+
+  /* u = bits / 2^53 = m * 2^(exponent - 53) with m in [1, 2) */
+  int exponent = 63 - __builtin_clzll(bits);
+  double m = ((double) bits) / ((double) (1ULL << exponent));
+  double t = (m - 1.0) / (m + 1.0);
+  double t2 = t * t;
+  double ln_m = 2.0 * t * (1.0 + (t2 / 3.0) + (t2 * t2 / 5.0) +
+                           (t2 * t2 * t2 / 7.0));
+  return ((53 - exponent) * 0.6931471805599453) - ln_m;
+} /* exponential_random() */
+
+/*
+ * Called by profile_tick() when the calling thread's countdown runs out.
+ * Starts a new countdown and returns true if the allocation that ran it out
+ * should be sampled.
+ */
+
+bool profile_sample_due(void) {
+  if (g_profile_rate == 0) {
+    g_profile_countdown = INT64_MAX;
+    return false;
+  }
+
+  double next = exponential_random() * g_profile_rate;
+  g_profile_countdown = (next < (double) INT64_MAX) ? (int64_t) next :
+                                                      INT64_MAX;
+
+  if (!g_profile_started) {
+    g_profile_started = true;
+    return false;
+  }
+  return !g_profile_busy;
+} /* profile_sample_due() */
+
+/*
+ * Returns the bucket of the table that holds the sample for address p.
+ */
+
+static inline size_t sample_bucket(void *p) {
+  return ((((uintptr_t) p) >> 4) * 0x9e3779b97f4a7c15ULL) >>
+         (64 - __builtin_ctz(PROFILE_BUCKETS));
+} /* sample_bucket() */
+
+/*
+ * Returns an unused sample record, mapping more from the OS if there are
+ * none left. The caller must hold g_profile_mutex.
+ *
+ * Returns NULL if the OS has no more memory to give.
+ */
+
+static sample *new_sample(void) {
+  if (g_free_samples == NULL) {
+    char *pool = mmap(NULL, PROFILE_POOL_SIZE, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (pool == MAP_FAILED) {
+      return NULL;
+    }
+    for (size_t offset = 0; offset + sizeof(sample) <= PROFILE_POOL_SIZE;
+         offset += sizeof(sample)) {
+      sample *s = (sample *) (pool + offset);
+      s->next = g_free_samples;
+      g_free_samples = s;
+    }
+  }
+  sample *s = g_free_samples;
+  g_free_samples = s->next;
+  return s;
+} /* new_sample() */
+
+/*
+ * Records the stack of the calling thread as the one that allocated the
+ * size bytes at p.
+ */
+
+void profile_record(void *p, size_t size) {
+  g_profile_busy = true;
+
+  /* leave out this function's own frame */
+  void *stack[PROFILE_MAX_DEPTH + 1];
+  int depth = backtrace(stack, PROFILE_MAX_DEPTH + 1) - 1;
+
+  pthread_mutex_lock(&g_profile_mutex);
+  sample *s = new_sample();
+  if (s != NULL) {
+    s->address = p;
+    s->size = size;
+    s->depth = (depth > 0) ? depth : 0;
+    memcpy(s->stack, stack + 1, s->depth * sizeof(void *));
+
+    size_t bucket = sample_bucket(p);
+    s->next = g_samples[bucket];
+    g_samples[bucket] = s;
+    __atomic_store_n(&g_sample_count, g_sample_count + 1, __ATOMIC_RELAXED);
+  }
+  pthread_mutex_unlock(&g_profile_mutex);
+
+  g_profile_busy = false;
+} /* profile_record() */
+
+/*
+ * Unlinks and returns the sample for address p, or returns NULL if p was not
+ * sampled. The caller must hold g_profile_mutex.
+ */
+
+static sample *take_sample(void *p) {
+  for (sample **link = &g_samples[sample_bucket(p)]; *link != NULL;
+       link = &(*link)->next) {
+    sample *s = *link;
+    if (s->address == p) {
+      *link = s->next;
+      __atomic_store_n(&g_sample_count, g_sample_count - 1,
+                       __ATOMIC_RELAXED);
+      return s;
+    }
+  }
+  return NULL;
+} /* take_sample() */
+
+/*
+ * Drops the sample for p, if there is one, because p is being freed.
+ */
+
+void profile_forget(void *p) {
+  if (__atomic_load_n(&g_sample_count, __ATOMIC_RELAXED) == 0) {
+    return;
+  }
+
+  pthread_mutex_lock(&g_profile_mutex);
+  sample *s = take_sample(p);
+  if (s != NULL) {
+    s->next = g_free_samples;
+    g_free_samples = s;
+  }
+  pthread_mutex_unlock(&g_profile_mutex);
+} /* profile_forget() */
+
+/*
+ * Moves the sample for old_p, if there is one, to new_p, which now holds
+ * size bytes. Used when a block is resized by remapping it.
+ */
+
+void profile_move(void *old_p, void *new_p, size_t size) {
+  if (__atomic_load_n(&g_sample_count, __ATOMIC_RELAXED) == 0) {
+    return;
+  }
+
+  pthread_mutex_lock(&g_profile_mutex);
+  sample *s = take_sample(old_p);
+  if (s != NULL) {
+    s->address = new_p;
+    s->size = size;
+    size_t bucket = sample_bucket(new_p);
+    s->next = g_samples[bucket];
+    g_samples[bucket] = s;
+    __atomic_store_n(&g_sample_count, g_sample_count + 1, __ATOMIC_RELAXED);
+  }
+  pthread_mutex_unlock(&g_profile_mutex);
+} /* profile_move() */
+
+/*
+ * Output buffer for profile_dump(), which can't use stdio since that would
+ * allocate.
+ */
+
+typedef struct dump_buffer {
+  int fd;
+  size_t length;
+  bool failed;
+  char data[4096];
+} dump_buffer;
+
+static void dump_flush(dump_buffer *out) {
+  size_t written = 0;
+  while ((written < out->length) && !out->failed) {
+    ssize_t n = write(out->fd, out->data + written, out->length - written);
+    if (n < 0) {
+      if (errno != EINTR) {
+        out->failed = true;
+      }
+      continue;
+    }
+    written += n;
+  }
+  out->length = 0;
+} /* dump_flush() */
+
+static void dump_printf(dump_buffer *out, const char *format, ...)
+  __attribute__((format(printf, 2, 3)));
+
+static void dump_printf(dump_buffer *out, const char *format, ...) {
+  char line[256];
+  va_list args;
+  va_start(args, format);
+  int length = vsnprintf(line, sizeof(line), format, args);
+  va_end(args);
+  if (length < 0) {
+    return;
+  }
+  if ((size_t) length >= sizeof(line)) {
+    length = sizeof(line) - 1;
+  }
+  if (out->length + length > sizeof(out->data)) {
+    dump_flush(out);
+  }
+  memcpy(out->data + out->length, line, length);
+  out->length += length;
+} /* dump_printf() */
+
+/*
+ * Writes the live samples to the file at path in the legacy heap profile
+ * format, followed by the process's memory map so pprof can symbolize the
+ * stacks:
+ *
+ *   pprof --text <program> <path>
+ *
+ * Returns 0 on success, or -1 with errno set if the file can't be written.
+ */
+
+int profile_dump(const char *path) {
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    return -1;
+  }
+
+  g_profile_busy = true;
+  dump_buffer out = { .fd = fd, .length = 0, .failed = false };
+
+  pthread_mutex_lock(&g_profile_mutex);
+  size_t total_bytes = 0;
+  for (size_t bucket = 0; bucket < PROFILE_BUCKETS; bucket++) {
+    for (sample *s = g_samples[bucket]; s != NULL; s = s->next) {
+      total_bytes += s->size;
+    }
+  }
+  dump_printf(&out, "heap profile: %zu: %zu [%zu: %zu] @ heap_v2/%zu\n",
+              g_sample_count, total_bytes, g_sample_count, total_bytes,
+              g_profile_rate);
+  for (size_t bucket = 0; bucket < PROFILE_BUCKETS; bucket++) {
+    for (sample *s = g_samples[bucket]; s != NULL; s = s->next) {
+      dump_printf(&out, "1: %zu [1: %zu] @", s->size, s->size);
+      for (int frame = 0; frame < s->depth; frame++) {
+        dump_printf(&out, " %p", s->stack[frame]);
+      }
+      dump_printf(&out, "\n");
+    }
+  }
+  pthread_mutex_unlock(&g_profile_mutex);
+
+  dump_printf(&out, "\nMAPPED_LIBRARIES:\n");
+  dump_flush(&out);
+  int maps = open("/proc/self/maps", O_RDONLY | O_CLOEXEC);
+  if (maps >= 0) {
+    ssize_t n = 0;
+    while ((n = read(maps, out.data, sizeof(out.data))) > 0) {
+      out.length = n;
+      dump_flush(&out);
+    }
+    close(maps);
+  }
+
+  g_profile_busy = false;
+  if (out.failed) {
+    int error = errno;
+    close(fd);
+    errno = error;
+    return -1;
+  }
+  return close(fd);
+} /* profile_dump() */
+
+/*
+ * Fork handlers, see my_malloc.c.
+ */
+
+void profile_lock(void) {
+  pthread_mutex_lock(&g_profile_mutex);
+} /* profile_lock() */
+
+void profile_unlock(void) {
+  pthread_mutex_unlock(&g_profile_mutex);
+} /* profile_unlock() */
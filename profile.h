@@ -0,0 +1,47 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * On average one allocation is sampled for every this many bytes
+ * requested. Can be changed at startup with the MALLOC_PROFILE_RATE
+ * environment variable, where 0 turns the profiler off.
+ */
+
+#ifndef PROFILE_SAMPLE_RATE
+#define PROFILE_SAMPLE_RATE (2 * 1024 * 1024)
+#endif
+
+/* Frames kept of each sampled allocation's stack */
+#define PROFILE_MAX_DEPTH (32)
+
+/* Bytes the calling thread may still allocate before its next sample */
+extern __thread int64_t g_profile_countdown;
+
+void profile_init(size_t rate);
+bool profile_sample_due(void);
+void profile_record(void *p, size_t size);
+void profile_forget(void *p);
+void profile_move(void *old_p, void *new_p, size_t size);
+int profile_dump(const char *path);
+void profile_lock(void);
+void profile_unlock(void);
+
+/*
+ * Counts size bytes against the calling thread's sampling countdown.
+ * Returns true if the allocation should be sampled, which is only worth a
+ * function call once the countdown runs out.
+ */
+
+static inline bool profile_tick(size_t size) {
+  g_profile_countdown -= (int64_t) size;
+  if (__builtin_expect(g_profile_countdown >= 0, 1)) {
+    return false;
+  }
+  return profile_sample_due();
+} /* profile_tick() */
+
+#endif // PROFILE_H
@@ -0,0 +1,477 @@
+#define _GNU_SOURCE
+
+#include <slab.h>
+#include <assert.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/*
+ * Header-less allocator for small requests. A slab is a SLAB_SIZE aligned
+ * run of pages holding equally sized slots for one size class, with its
+ * metadata at the start of the run, so the slab a pointer belongs to is
+ * found by masking off the low bits of the pointer. Free slots are kept on
+ * a singly linked list threaded through the slots themselves.
+ *
+ * All slabs are carved out of one virtual range reserved at startup, which
+ * lets my_free() tell slab pointers from boundary tag blocks with a bounds
+ * check. Like the thread caches in my_malloc.c, each thread keeps a small
+ * stack of free slots per size class so most small mallocs and frees take
+ * no lock at all.
+ */
+
+#define SLAB_SIZE ((size_t) 64 * 1024)
+
+#ifndef SLAB_REGION_SIZE
+#define SLAB_REGION_SIZE ((size_t) 1 << 30)
+#endif
+
+/* Offset of the first slot, keeps the slab metadata on its own cache line */
+#define SLAB_SLOTS_OFFSET (64)
+
+/* Slots moved between a thread's cache and the slabs at a time */
+#define SLAB_BATCH (32)
+#define SLAB_CACHE_MAX (2 * SLAB_BATCH)
+
+/*
+ * Size classes are multiples of 8 bytes up to 32 and multiples of 16 bytes
+ * above that.
+ */
+
+#define SLAB_CLASS_COUNT ((SLAB_MAX_SIZE <= 32) ? \
+                          (((SLAB_MAX_SIZE + 7) / 8) + 1) : \
+                          (5 + ((SLAB_MAX_SIZE - 33) / 16)))
+
+typedef struct slab {
+  /* Links in the size class's list of slabs with free slots */
+  struct slab *next;
+  struct slab *prev;
+
+  /* Slots that have been freed back to this slab */
+  void *free_slots;
+
+  /* Start of the slots that have never been handed out */
+  char *unused;
+
+  unsigned int slot_size;
+  unsigned int slot_count;
+  unsigned int free_count;
+  bool in_partial_list;
+} slab;
+
+_Static_assert(sizeof(slab) <= SLAB_SLOTS_OFFSET, "slab metadata too large");
+
+typedef struct slab_class {
+  pthread_mutex_t mutex;
+
+  /* Slabs that have at least one free slot */
+  slab *partial;
+
+  /* Slots taken out of this class's slabs, including thread cached ones */
+  size_t slots_in_use;
+} slab_class;
+
+typedef struct slab_cache {
+  void *slots[SLAB_CLASS_COUNT];
+  unsigned int counts[SLAB_CLASS_COUNT];
+  bool registered;
+} slab_cache;
+
+/* Bounds of the virtual range reserved for slabs */
+char *g_slab_base = NULL;
+char *g_slab_end = NULL;
+
+/* First slab in the reserved range that has never been used */
+static char *g_slab_next_unused = NULL;
+
+/* Slabs that emptied out and had their pages returned to the OS */
+static slab *g_empty_slabs = NULL;
+static size_t g_slab_released_count = 0;
+
+/* Mutex protecting g_slab_next_unused and g_empty_slabs */
+static pthread_mutex_t g_slab_region_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static slab_class g_slab_classes[SLAB_CLASS_COUNT];
+
+static size_t g_slab_page_size = 4096;
+
+static __thread slab_cache g_slab_cache;
+
+/* Key whose destructor drains a thread's slot cache when the thread exits */
+static pthread_key_t g_slab_cache_key;
+
+/*
+ * Returns the size class that a request of the given size falls in.
+ */
+
+static inline size_t slab_class_index(size_t size) {
+  if (size <= 32) {
+    return (size == 0) ? 0 : ((size + 7) / 8) - 1;
+  }
+  return 4 + ((size - 33) / 16);
+} /* slab_class_index() */
+
+/*
+ * Returns the slot size of the given size class.
+ */
+
+static inline size_t slab_class_size(size_t index) {
+  if (index < 4) {
+    return (index + 1) * 8;
+  }
+  return 32 + ((index - 3) * 16);
+} /* slab_class_size() */
+
+/*
+ * Returns the slab that a slot belongs to.
+ */
+
+static inline slab *slab_of(void *p) {
+  return (slab *) (((uintptr_t) p) & ~(SLAB_SIZE - 1));
+} /* slab_of() */
+
+/*
+ * Links a slab into its size class's list of slabs with free slots.
+ */
+
+static void slab_list_insert(slab_class *cls, slab *s) {
+  s->prev = NULL;
+  s->next = cls->partial;
+  if (cls->partial != NULL) {
+    cls->partial->prev = s;
+  }
+  cls->partial = s;
+  s->in_partial_list = true;
+} /* slab_list_insert() */
+
+/*
+ * Unlinks a slab from its size class's list of slabs with free slots.
+ */
+
+static void slab_list_remove(slab_class *cls, slab *s) {
+  if (s->prev != NULL) {
+    s->prev->next = s->next;
+  }
+  else {
+    cls->partial = s->next;
+  }
+  if (s->next != NULL) {
+    s->next->prev = s->prev;
+  }
+  s->next = NULL;
+  s->prev = NULL;
+  s->in_partial_list = false;
+} /* slab_list_remove() */
+
+/*
+ * Sets up a fresh slab for the given size class, reusing a released slab
+ * if there is one. Returns NULL once the reserved range is used up.
+ */
+
+static slab *slab_create(size_t index) {
+  pthread_mutex_lock(&g_slab_region_mutex);
+  slab *s = g_empty_slabs;
+  if (s != NULL) {
+    g_empty_slabs = s->next;
+    g_slab_released_count--;
+  }
+  else if (g_slab_next_unused < g_slab_end) {
+    /* make the next slab of the reserved range accessible */
+    if (mprotect(g_slab_next_unused, SLAB_SIZE,
+                 PROT_READ | PROT_WRITE) == 0) {
+      s = (slab *) g_slab_next_unused;
+      g_slab_next_unused += SLAB_SIZE;
+    }
+  }
+  pthread_mutex_unlock(&g_slab_region_mutex);
+
+  if (s == NULL) {
+    return NULL;
+  }
+
+  s->next = NULL;
+  s->prev = NULL;
+  s->free_slots = NULL;
+  s->unused = ((char *) s) + SLAB_SLOTS_OFFSET;
+  s->slot_size = slab_class_size(index);
+  s->slot_count = (SLAB_SIZE - SLAB_SLOTS_OFFSET) / s->slot_size;
+  s->free_count = s->slot_count;
+  s->in_partial_list = false;
+  return s;
+} /* slab_create() */
+
+/*
+ * Returns the pages of an empty slab to the OS and keeps the slab for
+ * reuse. The page holding the metadata stays mapped so the slab can be
+ * linked into g_empty_slabs.
+ */
+
+static void slab_release(slab *s) {
+  madvise(((char *) s) + g_slab_page_size, SLAB_SIZE - g_slab_page_size,
+          MADV_DONTNEED);
+
+  pthread_mutex_lock(&g_slab_region_mutex);
+  s->next = g_empty_slabs;
+  g_empty_slabs = s;
+  g_slab_released_count++;
+  pthread_mutex_unlock(&g_slab_region_mutex);
+} /* slab_release() */
+
+/*
+ * Takes one free slot out of a slab. The caller must hold the size class's
+ * mutex.
+ */
+
+static void *slab_take(slab_class *cls, slab *s) {
+  void *slot = s->free_slots;
+  if (slot != NULL) {
+    s->free_slots = *((void **) slot);
+  }
+  else {
+    slot = s->unused;
+    s->unused += s->slot_size;
+  }
+
+  s->free_count--;
+  cls->slots_in_use++;
+  if (s->free_count == 0) {
+    slab_list_remove(cls, s);
+  }
+  return slot;
+} /* slab_take() */
+
+/*
+ * Gives a slot back to its slab. Slabs that become empty are released as
+ * long as the size class has other slabs with free slots. The caller must
+ * hold the size class's mutex.
+ */
+
+static void slab_put(slab_class *cls, void *slot) {
+  slab *s = slab_of(slot);
+  *((void **) slot) = s->free_slots;
+  s->free_slots = slot;
+  s->free_count++;
+  cls->slots_in_use--;
+
+  if (!s->in_partial_list) {
+    slab_list_insert(cls, s);
+  }
+
+  if ((s->free_count == s->slot_count) &&
+      ((cls->partial != s) || (s->next != NULL))) {
+    slab_list_remove(cls, s);
+    slab_release(s);
+  }
+} /* slab_put() */
+
+/*
+ * Moves slots from the thread cache of the given size class back to their
+ * slabs until at most keep are left, taking the class's mutex once.
+ */
+
+static void slab_cache_flush(slab_cache *cache, size_t index,
+                             unsigned int keep) {
+  if (cache->counts[index] <= keep) {
+    return;
+  }
+
+  slab_class *cls = &g_slab_classes[index];
+  pthread_mutex_lock(&cls->mutex);
+  while (cache->counts[index] > keep) {
+    void *slot = cache->slots[index];
+    cache->slots[index] = *((void **) slot);
+    cache->counts[index]--;
+    slab_put(cls, slot);
+  }
+  pthread_mutex_unlock(&cls->mutex);
+} /* slab_cache_flush() */
+
+/*
+ * pthread key destructor that hands every slot cached by an exiting thread
+ * back to its slab.
+ */
+
+static void slab_cache_destroy(void *cache) {
+  for (size_t index = 0; index < SLAB_CLASS_COUNT; index++) {
+    slab_cache_flush((slab_cache *) cache, index, 0);
+  }
+} /* slab_cache_destroy() */
+
+/*
+ * Moves up to SLAB_BATCH free slots of the given size class into this
+ * thread's cache, taking the class's mutex once.
+ */
+
+static void slab_cache_refill(size_t index) {
+  slab_class *cls = &g_slab_classes[index];
+  pthread_mutex_lock(&cls->mutex);
+  for (int i = 0; i < SLAB_BATCH; i++) {
+    if (cls->partial == NULL) {
+      slab *s = slab_create(index);
+      if (s == NULL) {
+        break;
+      }
+      slab_list_insert(cls, s);
+    }
+
+    void *slot = slab_take(cls, cls->partial);
+    *((void **) slot) = g_slab_cache.slots[index];
+    g_slab_cache.slots[index] = slot;
+    g_slab_cache.counts[index]++;
+  }
+  pthread_mutex_unlock(&cls->mutex);
+} /* slab_cache_refill() */
+
+/*
+ * Reserves the virtual range slabs are carved from. If the reservation
+ * fails, slab_malloc() always returns NULL and small requests fall through
+ * to the regular heap.
+ */
+
+void slab_init(void) {
+  if (SLAB_MAX_SIZE == 0) {
+    return;
+  }
+
+  g_slab_page_size = sysconf(_SC_PAGESIZE);
+
+  for (size_t index = 0; index < SLAB_CLASS_COUNT; index++) {
+    pthread_mutex_init(&g_slab_classes[index].mutex, NULL);
+  }
+  pthread_key_create(&g_slab_cache_key, slab_cache_destroy);
+
+  /* reserve one extra slab so the range can be aligned to SLAB_SIZE */
+  char *reserved = mmap(NULL, SLAB_REGION_SIZE + SLAB_SIZE, PROT_NONE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (reserved == MAP_FAILED) {
+    return;
+  }
+
+  char *aligned = (char *) ((((uintptr_t) reserved) + SLAB_SIZE - 1) &
+                            ~(SLAB_SIZE - 1));
+  if (aligned != reserved) {
+    munmap(reserved, aligned - reserved);
+  }
+  munmap(aligned + SLAB_REGION_SIZE, SLAB_SIZE - (aligned - reserved));
+
+  g_slab_next_unused = aligned;
+  g_slab_base = aligned;
+  g_slab_end = aligned + SLAB_REGION_SIZE;
+} /* slab_init() */
+
+/*
+ * Returns a slot of at least size bytes, or NULL if size is too large for
+ * the slab allocator or the slab range is exhausted.
+ */
+
+void *slab_malloc(size_t size) {
+  if ((size > SLAB_MAX_SIZE) || (g_slab_base == NULL)) {
+    return NULL;
+  }
+
+  size_t index = slab_class_index(size);
+  if (g_slab_cache.slots[index] == NULL) {
+    /* register the cache so it is drained when the thread exits */
+    if (!g_slab_cache.registered) {
+      g_slab_cache.registered = true;
+      pthread_setspecific(g_slab_cache_key, &g_slab_cache);
+    }
+
+    slab_cache_refill(index);
+    if (g_slab_cache.slots[index] == NULL) {
+      return NULL;
+    }
+  }
+
+  void *slot = g_slab_cache.slots[index];
+  g_slab_cache.slots[index] = *((void **) slot);
+  g_slab_cache.counts[index]--;
+  return slot;
+} /* slab_malloc() */
+
+/*
+ * Frees a slot handed out by slab_malloc().
+ */
+
+void slab_free(void *p) {
+  assert(slab_owns(p));
+
+  if (!g_slab_cache.registered) {
+    g_slab_cache.registered = true;
+    pthread_setspecific(g_slab_cache_key, &g_slab_cache);
+  }
+
+  size_t index = slab_class_index(slab_of(p)->slot_size);
+  *((void **) p) = g_slab_cache.slots[index];
+  g_slab_cache.slots[index] = p;
+  g_slab_cache.counts[index]++;
+
+  if (g_slab_cache.counts[index] > SLAB_CACHE_MAX) {
+    slab_cache_flush(&g_slab_cache, index, SLAB_BATCH);
+  }
+} /* slab_free() */
+
+/*
+ * Returns the number of bytes of the slab range currently backed by memory
+ * from the OS.
+ */
+
+size_t slab_os_bytes(void) {
+  pthread_mutex_lock(&g_slab_region_mutex);
+  size_t bytes = 0;
+  if (g_slab_base != NULL) {
+    bytes = (g_slab_next_unused - g_slab_base) -
+            (g_slab_released_count * (SLAB_SIZE - g_slab_page_size));
+  }
+  pthread_mutex_unlock(&g_slab_region_mutex);
+  return bytes;
+} /* slab_os_bytes() */
+
+/*
+ * Returns the number of bytes in slots that have been handed out, counting
+ * slots held in thread caches.
+ */
+
+size_t slab_bytes_in_use(void) {
+  size_t bytes = 0;
+  for (size_t index = 0; index < SLAB_CLASS_COUNT; index++) {
+    slab_class *cls = &g_slab_classes[index];
+    pthread_mutex_lock(&cls->mutex);
+    bytes += cls->slots_in_use * slab_class_size(index);
+    pthread_mutex_unlock(&cls->mutex);
+  }
+  return bytes;
+} /* slab_bytes_in_use() */
+
+/*
+ * Returns the number of usable bytes in a slot.
+ */
+
+size_t slab_usable_size(void *p) {
+  return slab_of(p)->slot_size;
+} /* slab_usable_size() */
+
+/*
+ * Takes every lock in the slab allocator, class locks before the region
+ * lock like slab_cache_refill() does, so that fork() can't copy one held.
+ */
+
+void slab_lock_all(void) {
+  for (size_t index = 0; index < SLAB_CLASS_COUNT; index++) {
+    pthread_mutex_lock(&g_slab_classes[index].mutex);
+  }
+  pthread_mutex_lock(&g_slab_region_mutex);
+} /* slab_lock_all() */
+
+/*
+ * Releases the locks taken by slab_lock_all().
+ */
+
+void slab_unlock_all(void) {
+  pthread_mutex_unlock(&g_slab_region_mutex);
+  for (size_t index = 0; index < SLAB_CLASS_COUNT; index++) {
+    pthread_mutex_unlock(&g_slab_classes[index].mutex);
+  }
+} /* slab_unlock_all() */
@@ -0,0 +1,37 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/*
+ * Requests of up to this many bytes are served from slabs, which carry no
+ * per-block header. Setting it to 0 disables the slab allocator.
+ */
+
+#ifndef SLAB_MAX_SIZE
+#define SLAB_MAX_SIZE (64)
+#endif
+
+/* Bounds of the virtual range reserved for slabs */
+extern char *g_slab_base;
+extern char *g_slab_end;
+
+void slab_init(void);
+void *slab_malloc(size_t size);
+void slab_free(void *p);
+size_t slab_usable_size(void *p);
+size_t slab_os_bytes(void);
+size_t slab_bytes_in_use(void);
+void slab_lock_all(void);
+void slab_unlock_all(void);
+
+/*
+ * Returns true if p was handed out by slab_malloc().
+ */
+
+static inline bool slab_owns(void *p) {
+  return (((char *) p) >= g_slab_base) && (((char *) p) < g_slab_end);
+} /* slab_owns() */
+
+#endif // SLAB_H
@@ -0,0 +1,396 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "heap_snapshot.h"
+
+/*
+ * Offline analysis of a heap snapshot written by my_malloc_snapshot().
+ * Usage:
+ *
+ *   heapmap [-c columns] [-r rows] [-i image.ppm] <snapshot>
+ *
+ * Prints a summary per arena, a histogram of free block sizes, the largest
+ * free blocks and the largest runs of free and cached blocks (what
+ * consolidating the fastbins would leave), and a text heatmap of how much
+ * of each stretch of the heap is free. The heatmap lays the chunks end to
+ * end, skipping the gaps between them, and with -i is also written as a
+ * PPM image with one pixel per cell.
+ */
+
+#define DEFAULT_COLUMNS (64)
+#define DEFAULT_ROWS (32)
+
+/* Entries in the largest free block and run reports */
+#define TOP_COUNT (10)
+
+/* Free block histogram classes, by power of two */
+#define SIZE_CLASS_COUNT (48)
+
+/* Characters of the text heatmap, from no free memory to all free */
+static const char g_shades[] = " .:-=+*#%@";
+#define SHADE_COUNT (sizeof(g_shades) - 1)
+
+typedef struct arena_totals {
+  uint64_t allocated;
+  uint64_t free;
+  uint64_t cached;
+  uint64_t largest_free;
+  uint64_t blocks;
+} arena_totals;
+
+typedef struct run {
+  uint64_t address;
+  uint64_t size;
+  unsigned int arena;
+} run;
+
+/* Bytes of each kind in a heatmap cell */
+typedef struct cell {
+  double allocated;
+  double free;
+  double cached;
+  uint64_t address;
+} cell;
+
+/*
+ * Keeps top[] sorted from the largest run down, replacing the smallest if
+ * r is bigger.
+ */
+
+static void top_insert(run *top, run r) {
+  if (r.size <= top[TOP_COUNT - 1].size) {
+    return;
+  }
+  int i = TOP_COUNT - 1;
+  while ((i > 0) && (top[i - 1].size < r.size)) {
+    top[i] = top[i - 1];
+    i--;
+  }
+  top[i] = r;
+} /* top_insert() */
+
+static void print_top(const char *title, run *top) {
+  printf("\n%s\n", title);
+  for (int i = 0; (i < TOP_COUNT) && (top[i].size != 0); i++) {
+    printf("  %#14lx  %12lu bytes  arena %u\n", (unsigned long) top[i].address,
+           (unsigned long) top[i].size, top[i].arena);
+  }
+} /* print_top() */
+
+/*
+ * Returns 1 - largest / total, or 0 if there is nothing free.
+ */
+
+static double fragmentation(uint64_t largest, uint64_t total) {
+  return (total == 0) ? 0.0 : 1.0 - (((double) largest) / ((double) total));
+} /* fragmentation() */
+
+/*
+ * Spreads size bytes of the given state starting at offset over the cells
+ * they cover.
+ */
+
+static void add_to_cells(cell *cells, size_t cell_count, uint64_t cell_bytes,
+                         uint64_t offset, uint64_t size, int block_state) {
+  while (size > 0) {
+    size_t index = offset / cell_bytes;
+    if (index >= cell_count) {
+      return;
+    }
+    uint64_t in_cell = ((index + 1) * cell_bytes) - offset;
+    if (in_cell > size) {
+      in_cell = size;
+    }
+    if (block_state == HEAP_BLOCK_FREE) {
+      cells[index].free += in_cell;
+    }
+    else if (block_state == HEAP_BLOCK_CACHED) {
+      cells[index].cached += in_cell;
+    }
+    else {
+      cells[index].allocated += in_cell;
+    }
+    offset += in_cell;
+    size -= in_cell;
+  }
+} /* add_to_cells() */
+
+/*
+ * Writes the heatmap as a binary PPM image. Free memory is red, cached
+ * blocks are yellow and allocated memory is blue.
+ */
+
+static bool write_image(const char *path, cell *cells, size_t columns,
+                        size_t rows) {
+  FILE *f = fopen(path, "wb");
+  if (f == NULL) {
+    return false;
+  }
+  fprintf(f, "P6\n%zu %zu\n255\n", columns, rows);
+  for (size_t i = 0; i < columns * rows; i++) {
+    double total = cells[i].allocated + cells[i].free + cells[i].cached;
+    unsigned char rgb[3] = { 0, 0, 0 };
+    if (total > 0) {
+      double f_free = cells[i].free / total;
+      double f_cached = cells[i].cached / total;
+      double f_used = cells[i].allocated / total;
+      rgb[0] = (unsigned char) ((230 * f_free) + (230 * f_cached) +
+                                (50 * f_used));
+      rgb[1] = (unsigned char) ((50 * f_free) + (200 * f_cached) +
+                                (80 * f_used));
+      rgb[2] = (unsigned char) ((50 * f_free) + (50 * f_cached) +
+                                (200 * f_used));
+    }
+    fwrite(rgb, 1, sizeof(rgb), f);
+  }
+  return fclose(f) == 0;
+} /* write_image() */
+
+int main(int argc, char **argv) {
+  size_t columns = DEFAULT_COLUMNS;
+  size_t rows = DEFAULT_ROWS;
+  const char *image_path = NULL;
+  int option = 0;
+  while ((option = getopt(argc, argv, "c:r:i:")) != -1) {
+    switch (option) {
+      case 'c':
+        columns = strtoul(optarg, NULL, 0);
+        break;
+      case 'r':
+        rows = strtoul(optarg, NULL, 0);
+        break;
+      case 'i':
+        image_path = optarg;
+        break;
+      default:
+        columns = 0;
+        break;
+    }
+  }
+  if ((optind != argc - 1) || (columns == 0) || (rows == 0)) {
+    fprintf(stderr, "usage: %s [-c columns] [-r rows] [-i image.ppm] "
+                    "<snapshot>\n", argv[0]);
+    return 2;
+  }
+
+  FILE *f = fopen(argv[optind], "rb");
+  if (f == NULL) {
+    perror(argv[optind]);
+    return 1;
+  }
+  heap_snapshot_header snapshot;
+  if ((fread(&snapshot, sizeof(snapshot), 1, f) != 1) ||
+      (memcmp(snapshot.magic, HEAP_SNAPSHOT_MAGIC,
+              sizeof(snapshot.magic)) != 0)) {
+    fprintf(stderr, "heapmap: %s is not a heap snapshot\n", argv[optind]);
+    return 1;
+  }
+  heap_snapshot_block *blocks = malloc((snapshot.block_count + 1) *
+                                       sizeof(*blocks));
+  if ((blocks == NULL) ||
+      (fread(blocks, sizeof(*blocks), snapshot.block_count, f) !=
+       snapshot.block_count)) {
+    fprintf(stderr, "heapmap: %s is truncated\n", argv[optind]);
+    return 1;
+  }
+  fclose(f);
+
+  /* totals, histogram and largest blocks and runs, in one pass */
+  arena_totals *arenas = calloc(snapshot.arena_count + 1, sizeof(*arenas));
+  uint64_t class_counts[SIZE_CLASS_COUNT] = { 0 };
+  uint64_t class_bytes[SIZE_CLASS_COUNT] = { 0 };
+  run top_free[TOP_COUNT];
+  run top_runs[TOP_COUNT];
+  memset(top_free, 0, sizeof(top_free));
+  memset(top_runs, 0, sizeof(top_runs));
+  run current = { 0, 0, 0 };
+  uint64_t chunks = 0;
+  bool in_chunk = false;
+  uint64_t heap_bytes = 0;
+  uint64_t largest_run = 0;
+  for (uint64_t i = 0; i < snapshot.block_count; i++) {
+    heap_snapshot_block *b = &blocks[i];
+    unsigned int arena = HEAP_BLOCK_ARENA(b);
+    if (arena >= snapshot.arena_count) {
+      arena = snapshot.arena_count;
+    }
+    int block_state = HEAP_BLOCK_STATE(b);
+    arena_totals *totals = &arenas[arena];
+    heap_bytes += b->size;
+
+    /* free and cached neighbors would be one block after consolidation */
+    if ((block_state == HEAP_BLOCK_FREE) ||
+        (block_state == HEAP_BLOCK_CACHED)) {
+      if (current.size == 0) {
+        current.address = HEAP_BLOCK_ADDRESS(b);
+        current.arena = arena;
+      }
+      current.size += b->size;
+    }
+    else if (current.size != 0) {
+      top_insert(top_runs, current);
+      if (current.size > largest_run) {
+        largest_run = current.size;
+      }
+      current.size = 0;
+    }
+
+    switch (block_state) {
+      case HEAP_BLOCK_FREE: {
+        totals->free += b->size;
+        if (b->size > totals->largest_free) {
+          totals->largest_free = b->size;
+        }
+        int size_class = 63 - __builtin_clzll(b->size);
+        if (size_class >= SIZE_CLASS_COUNT) {
+          size_class = SIZE_CLASS_COUNT - 1;
+        }
+        class_counts[size_class]++;
+        class_bytes[size_class] += b->size;
+        run r = { HEAP_BLOCK_ADDRESS(b), b->size, arena };
+        top_insert(top_free, r);
+        break;
+      }
+      case HEAP_BLOCK_CACHED:
+        totals->cached += b->size;
+        break;
+      case HEAP_BLOCK_FENCEPOST:
+        /* every chunk starts and ends with one */
+        if (!in_chunk) {
+          chunks++;
+        }
+        in_chunk = !in_chunk;
+        totals->allocated += b->size;
+        break;
+      default:
+        totals->allocated += b->size;
+        break;
+    }
+    totals->blocks++;
+  }
+  if (current.size != 0) {
+    top_insert(top_runs, current);
+    if (current.size > largest_run) {
+      largest_run = current.size;
+    }
+  }
+
+  arena_totals all = { 0, 0, 0, 0, 0 };
+  for (unsigned int a = 0; a <= snapshot.arena_count; a++) {
+    all.allocated += arenas[a].allocated;
+    all.free += arenas[a].free;
+    all.cached += arenas[a].cached;
+    all.blocks += arenas[a].blocks;
+    if (arenas[a].largest_free > all.largest_free) {
+      all.largest_free = arenas[a].largest_free;
+    }
+  }
+
+  printf("heap: %lu bytes in %lu chunks, %lu blocks\n",
+         (unsigned long) heap_bytes, (unsigned long) chunks,
+         (unsigned long) all.blocks);
+  printf("outside the arenas: %lu bytes mapped, %lu of %lu slab bytes in "
+         "use\n", (unsigned long) snapshot.mmapped_bytes,
+         (unsigned long) snapshot.slab_bytes_in_use,
+         (unsigned long) snapshot.slab_bytes);
+  printf("\n%-6s %14s %14s %14s %14s %8s\n", "arena", "allocated", "free",
+         "cached", "largest free", "frag");
+  for (unsigned int a = 0; a < snapshot.arena_count; a++) {
+    if (arenas[a].blocks == 0) {
+      continue;
+    }
+    printf("%-6u %14lu %14lu %14lu %14lu %8.4f\n", a,
+           (unsigned long) arenas[a].allocated, (unsigned long) arenas[a].free,
+           (unsigned long) arenas[a].cached,
+           (unsigned long) arenas[a].largest_free,
+           fragmentation(arenas[a].largest_free, arenas[a].free));
+  }
+  printf("%-6s %14lu %14lu %14lu %14lu %8.4f\n", "all",
+         (unsigned long) all.allocated, (unsigned long) all.free,
+         (unsigned long) all.cached, (unsigned long) all.largest_free,
+         fragmentation(all.largest_free, all.free));
+  printf("after consolidating cached blocks: largest free %lu, "
+         "fragmentation %.4f\n", (unsigned long) largest_run,
+         fragmentation(largest_run, all.free + all.cached));
+
+  /* free block sizes, one bar of up to 50 characters per class */
+  printf("\nfree block sizes\n");
+  uint64_t most_bytes = 0;
+  for (int c = 0; c < SIZE_CLASS_COUNT; c++) {
+    if (class_bytes[c] > most_bytes) {
+      most_bytes = class_bytes[c];
+    }
+  }
+  for (int c = 0; c < SIZE_CLASS_COUNT; c++) {
+    if (class_counts[c] == 0) {
+      continue;
+    }
+    int bar = (int) ((50 * class_bytes[c] + most_bytes - 1) / most_bytes);
+    printf("  %12lu - %-12lu %9lu blocks %14lu bytes  %.*s\n",
+           1UL << c, (2UL << c) - 1, (unsigned long) class_counts[c],
+           (unsigned long) class_bytes[c], bar,
+           "##################################################");
+  }
+
+  print_top("largest free blocks", top_free);
+  print_top("largest runs of free and cached blocks", top_runs);
+
+  /* heatmap over the chunks laid end to end */
+  size_t cell_count = columns * rows;
+  uint64_t cell_bytes = (heap_bytes + cell_count - 1) / cell_count;
+  cell_bytes = (cell_bytes + 15) & ~15ULL;
+  if (cell_bytes == 0) {
+    cell_bytes = 16;
+  }
+  cell *cells = calloc(cell_count, sizeof(*cells));
+  uint64_t offset = 0;
+  for (uint64_t i = 0; i < snapshot.block_count; i++) {
+    /* label every cell the block covers with the address it starts at */
+    uint64_t address = HEAP_BLOCK_ADDRESS(&blocks[i]);
+    for (size_t index = offset / cell_bytes;
+         (index < cell_count) && (index * cell_bytes < offset + blocks[i].size);
+         index++) {
+      uint64_t cell_start = index * cell_bytes;
+      if (cells[index].address == 0) {
+        cells[index].address = address + ((cell_start > offset) ?
+                                          cell_start - offset : 0);
+      }
+    }
+    add_to_cells(cells, cell_count, cell_bytes, offset, blocks[i].size,
+                 HEAP_BLOCK_STATE(&blocks[i]));
+    offset += blocks[i].size;
+  }
+
+  printf("\nfree memory by address, %lu bytes per cell, '%c' none free to "
+         "'%c' all free\n", (unsigned long) cell_bytes, g_shades[0],
+         g_shades[SHADE_COUNT - 1]);
+  for (size_t row = 0; row < rows; row++) {
+    if (row * columns * cell_bytes >= heap_bytes) {
+      break;
+    }
+    cell *first = &cells[row * columns];
+    printf("  %#14lx |", (unsigned long) first->address);
+    for (size_t column = 0; column < columns; column++) {
+      cell *c = &first[column];
+      double total = c->allocated + c->free + c->cached;
+      if (total == 0) {
+        putchar(' ');
+        continue;
+      }
+      size_t shade = (size_t) ((c->free / total) * SHADE_COUNT);
+      putchar(g_shades[(shade >= SHADE_COUNT) ? SHADE_COUNT - 1 : shade]);
+    }
+    printf("|\n");
+  }
+
+  if ((image_path != NULL) &&
+      !write_image(image_path, cells, columns, rows)) {
+    perror(image_path);
+    return 1;
+  }
+  return 0;
+} /* main() */